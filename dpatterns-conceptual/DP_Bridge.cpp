@@ -30,6 +30,14 @@
 //============================================================================
 
 #include <iostream>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <fcntl.h>		//POSIX: sending the benchmark output to /dev/null
+#include <unistd.h>
+#include "DP_LogSink.h"	//device messages go through a buffered asynchronous sink
 using namespace std;
 
 //Implementer (implements buttons 7/8 for everyone; demands implementation of 5/6; it
@@ -46,14 +54,14 @@ class Device {
 		virtual void button6Pressed() = 0;	//channel or track up
 		void button7Pressed()				//volume up
 		{	volumeSetting += (volumeSetting<maxVolume ? 1 : 0);
-			cout << "\tVolume up = " << volumeSetting << endl;
+			LogSink::log("\tVolume up = %ld", volumeSetting);
 		}
 		void button8Pressed()				//volume down
 		{	volumeSetting -= (volumeSetting>0 ? 1 : 0);
-			cout << "\tVolume down = " << volumeSetting << endl;
+			LogSink::log("\tVolume down = %ld", volumeSetting);
 		}
 		void deviceFeedback()				//print current status
-		{ cout << "\tPlaying " << deviceState << " with volume " << volumeSetting << endl; }
+		{ LogSink::log("\tPlaying %ld with volume %ld", deviceState, volumeSetting); }
 };
 //Concrete implementer (implements 5/6 for each device)
 class TV : public Device {
@@ -61,11 +69,11 @@ class TV : public Device {
 		TV (int maxDState) { maxState = maxDState; }
 		void button5Pressed()
 		{	deviceState -= (deviceState>0 ? 1 : 0);
-			cout << "\tChannel down = " << deviceState << endl;
+			LogSink::log("\tChannel down = %ld", deviceState);
 		}
 		void button6Pressed()
 		{	deviceState += (deviceState<maxState ? 1 : 0);
-			cout << "\tChannel up = " << deviceState << endl;
+			LogSink::log("\tChannel up = %ld", deviceState);
 		}
 };
 //Concrete implementer (implements 5/6 for each device)
@@ -74,11 +82,11 @@ class DVD : public Device {
 		DVD (int maxDState) { maxState = maxDState; }
 		void button5Pressed()
 		{	deviceState = (deviceState>0 ? --deviceState : maxState); //circular 1, 0, max, max-1...
-			cout << "\tTrack down = " << deviceState << endl;
+			LogSink::log("\tTrack down = %ld", deviceState);
 		}
 		void button6Pressed()
 		{	deviceState = (deviceState<maxState ? ++deviceState : 0); //circular max-1, max, 0, 1...
-			cout << "\tTrack up = " << deviceState << endl;
+			LogSink::log("\tTrack up = %ld", deviceState);
 		}
 };
 
@@ -105,7 +113,7 @@ class TVRemoteMute : public RemoteButton {
 		bool muteState = false;
 	public:
 		TVRemoteMute(Device *d) : RemoteButton(d) {}
-		void button9Pressed() { muteState = !muteState; cout << (muteState ? "\tTV muted!" : "\tTV unmuted!") << endl;}
+		void button9Pressed() { muteState = !muteState; LogSink::log(muteState ? "\tTV muted!" : "\tTV unmuted!");}
 };
 //Implements button 9 for TV in cases it pauses/resumes device
 class TVRemotePause : public RemoteButton {
@@ -113,7 +121,7 @@ class TVRemotePause : public RemoteButton {
 		bool pauseState = false;
 	public:
 		TVRemotePause(Device *d) : RemoteButton(d) {}
-		void button9Pressed() { pauseState = !pauseState; cout << (pauseState ? "\tTV paused!" : "\tTV resumed!") << endl;}
+		void button9Pressed() { pauseState = !pauseState; LogSink::log(pauseState ? "\tTV paused!" : "\tTV resumed!");}
 };
 //Implements button 9 for DVD pausing/resuming device
 class DVDRemotePause : public RemoteButton {
@@ -121,18 +129,70 @@ class DVDRemotePause : public RemoteButton {
 		bool pauseState = false;
 	public:
 		DVDRemotePause(Device *d) : RemoteButton(d) {}
-		void button9Pressed() { pauseState = !pauseState; cout << (pauseState ? "\tDVD paused!" : "\tDVD resumed!") << endl;}
+		void button9Pressed() { pauseState = !pauseState; LogSink::log(pauseState ? "\tDVD paused!" : "\tDVD resumed!");}
 };
 
 
 
-int main() {
+//BENCHMARK (run with --bench): channel and volume button events on TVs, from 1 and 4
+//threads, written with cout << endl (the former device code), through the sink, and
+//with the sink switched off; the standard output goes to /dev/null meanwhile
+void runLoggingBenchmark() {
+	const int eventsPerThread = 1000000;
+	cout.flush();
+	int console = dup(STDOUT_FILENO), devNull = open("/dev/null", O_WRONLY);
+	dup2(devNull, STDOUT_FILENO);
+	string results;
+
+	for (int nThreads : {1, 4}) {
+		for (int mode=0; mode<3; ++mode) {	//cout, sink on, sink off
+			LogSink::setLevel(mode == 2 ? LogSink::Level::Off : LogSink::Level::Info);
+			auto start = chrono::steady_clock::now();
+			vector<thread> threads;
+			for (int t=0; t<nThreads; ++t)
+				threads.emplace_back([&, mode]() {
+					TV tv(100);
+					for (int i=0; i<eventsPerThread; ++i) {
+						if (mode > 0) {
+							if (i & 1) tv.button6Pressed();
+							else tv.button7Pressed();
+						} else if (i & 1)
+							cout << "\tChannel up = " << i << endl;
+						else
+							cout << "\tVolume up = " << i << endl;
+					}
+				});
+			for (auto &t : threads)
+				t.join();
+			double producersSecs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			LogSink::flush();
+			double totalSecs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			double events = double(nThreads) * eventsPerThread;
+			results += to_string(nThreads) + (nThreads == 1 ? " thread,  " : " threads, ")
+					 + (mode == 0 ? "cout << endl: " : mode == 1 ? "sink on:      " : "sink off:     ")
+					 + to_string(events / producersSecs / 1e6) + " M events/s in the devices, "
+					 + to_string(events / totalSecs / 1e6) + " M events/s written\n";
+		}
+	}
+	LogSink::setLevel(LogSink::Level::Info);
+	dup2(console, STDOUT_FILENO);
+	close(console);
+	close(devNull);
+	cout << results;
+}
+
+int main(int argc, char *argv[]) {
+
+	if (argc > 1 && string(argv[1]) == "--bench") {
+		runLoggingBenchmark();
+		return 0;
+	}
 
 	RemoteButton *tv1 = new TVRemoteMute  (new TV(5));
 	RemoteButton *tv2 = new TVRemotePause (new TV(4));
 	RemoteButton *dvd = new DVDRemotePause(new DVD(10));
 
-	cout << "Testing TV1..." << endl;
+	LogSink::log("Testing TV1...");
 	tv1->button6Pressed();
 	tv1->button6Pressed();
 	tv1->button5Pressed();
@@ -145,7 +205,7 @@ int main() {
 	tv1->button8Pressed();
 	tv1->deviceFeedback();
 
-	cout << "Testing TV2..." << endl;
+	LogSink::log("Testing TV2...");
 	tv2->button6Pressed();
 	tv2->button6Pressed();
 	tv2->button5Pressed();
@@ -158,7 +218,7 @@ int main() {
 	tv2->button8Pressed();
 	tv2->deviceFeedback();
 
-	cout << "Testing DVD..." << endl;
+	LogSink::log("Testing DVD...");
 	dvd->button6Pressed();
 	dvd->button6Pressed();
 	dvd->button5Pressed();
@@ -175,6 +235,7 @@ int main() {
 	delete tv1;
 	delete tv2;
 	delete dvd;
-	cout << "END OF PROGRAM" << endl; // prints END OF PROGRAM
+	LogSink::log("END OF PROGRAM"); // prints END OF PROGRAM
+	LogSink::flush();
 	return 0;
 }
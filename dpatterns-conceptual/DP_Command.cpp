@@ -19,6 +19,27 @@
 
 #include <iostream>
 #include <list>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <cstdlib>
+#include <new>
+#include <cstdint>
+#include <array>
+#include <cstring>
+#include <cstdio>
+#include <sys/mman.h>	//POSIX: memory mapped command journal
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "DP_LogSink.h"	//device messages go through a buffered asynchronous sink
 using namespace std;
 
 class ElectronicDevice {
@@ -28,24 +49,55 @@ class ElectronicDevice {
 		virtual void off() = 0;
 		virtual void volumeUp() = 0;
 		virtual void volumeDown() = 0;
+		//several volume steps in one call; returns the change really applied
+		virtual int adjustVolume(int delta) {
+			int before = getVolume();
+			for (int i=0; i<delta; ++i) volumeUp();
+			for (int i=0; i<-delta; ++i) volumeDown();
+			return getVolume() - before;
+		}
+		//state saved by the command journal, restored without executing commands
+		virtual int getVolume() const = 0;
+		virtual bool isOn() const = 0;
+		virtual void restoreState(int vol, bool power) = 0;
 };
 class Television : public ElectronicDevice {
 	private:
 		int volume = 0;
+		bool power = false;
 	public:
-		virtual void on() { cout << "\tTV is on!" << endl; }
-		virtual void off() { cout << "\tTV is off!" << endl;}
-		virtual void volumeUp() { cout << "\tVolume = " << (volume<10 ? ++volume : volume) << endl; }
-		virtual void volumeDown() { cout << "\tVolume = " << (volume>0 ? --volume : volume) << endl; }
+		virtual void on() { power = true; LogSink::log("\tTV is on!"); }
+		virtual void off() { power = false; LogSink::log("\tTV is off!");}
+		virtual void volumeUp() { LogSink::log("\tVolume = %ld", volume<10 ? ++volume : volume); }
+		virtual void volumeDown() { LogSink::log("\tVolume = %ld", volume>0 ? --volume : volume); }
+		virtual int adjustVolume(int delta) {
+			int old = volume;
+			volume = max(0, min(10, volume + delta));
+			LogSink::log("\tVolume = %ld", volume);
+			return volume - old;
+		}
+		virtual int getVolume() const { return volume; }
+		virtual bool isOn() const { return power; }
+		virtual void restoreState(int vol, bool pwr) { volume = vol; power = pwr; }
 };
 class Radio : public ElectronicDevice {
 	private:
 		int volume = 0;
+		bool power = false;
 	public:
-		virtual void on() { cout << "\tRadio is on!" << endl; }
-		virtual void off() { cout << "\tRadio is off!" << endl;}
-		virtual void volumeUp() { cout << "\tVolume = " << (volume<10 ? ++volume : volume) << endl; }
-		virtual void volumeDown() { cout << "\tVolume = " << (volume>0 ? --volume : volume) << endl; }
+		virtual void on() { power = true; LogSink::log("\tRadio is on!"); }
+		virtual void off() { power = false; LogSink::log("\tRadio is off!");}
+		virtual void volumeUp() { LogSink::log("\tVolume = %ld", volume<10 ? ++volume : volume); }
+		virtual void volumeDown() { LogSink::log("\tVolume = %ld", volume>0 ? --volume : volume); }
+		virtual int adjustVolume(int delta) {
+			int old = volume;
+			volume = max(0, min(10, volume + delta));
+			LogSink::log("\tVolume = %ld", volume);
+			return volume - old;
+		}
+		virtual int getVolume() const { return volume; }
+		virtual bool isOn() const { return power; }
+		virtual void restoreState(int vol, bool pwr) { volume = vol; power = pwr; }
 };
 
 
@@ -54,12 +106,14 @@ class Command {
 		virtual ~Command() {}
 		virtual void execute() = 0;
 		virtual void undo() = 0;
+		virtual ElectronicDevice *getDevice() { return nullptr; }	//receiver, if there is a single one
 };
 class TurnTVOn : public Command {
 	private:
 		ElectronicDevice * device;
 	public:
 		TurnTVOn(ElectronicDevice *dev) : device(dev) {}
+		ElectronicDevice *getDevice() { return device; }
 		void execute() { device->on(); }
 		void undo() {}
 };
@@ -68,6 +122,7 @@ class TurnTVOff : public Command {
 		ElectronicDevice * device;
 	public:
 		TurnTVOff(ElectronicDevice *dev) : device(dev) {}
+		ElectronicDevice *getDevice() { return device; }
 		void execute() { device->off(); }
 		void undo() {}
 };
@@ -76,6 +131,7 @@ class TurnTVUp : public Command {
 		ElectronicDevice * device;
 	public:
 		TurnTVUp(ElectronicDevice *dev) : device(dev) {}
+		ElectronicDevice *getDevice() { return device; }
 		void execute() { device->volumeUp(); }
 		void undo() { device->volumeDown(); }
 };
@@ -84,6 +140,7 @@ class TurnTVDown : public Command {
 		ElectronicDevice * device;
 	public:
 		TurnTVDown(ElectronicDevice *dev) : device(dev) {}
+		ElectronicDevice *getDevice() { return device; }
 		void execute() { device->volumeDown(); }
 		void undo() { device->volumeUp(); }
 };
@@ -91,20 +148,278 @@ class TurnItAllOff : public Command {
 	private:
 		list<ElectronicDevice *> devices;
 	public:
-		TurnItAllOff(list<ElectronicDevice *> listDev) : devices(listDev) {}
+		TurnItAllOff(const list<ElectronicDevice *> &listDev) : devices(listDev) {}
 		void execute() { for (auto dev : devices) dev->off(); }
 		void undo() {}
 };
 
 
-//Invoker
+//Command value: holds any Command implementation, or a lambda (with an optional undo
+//lambda), in an inline buffer instead of on the heap. It can be moved into queues and
+//history buffers like any value; objects larger than CAPACITY are rejected at compile time
+class InlineCommand {
+	public:
+		static const size_t CAPACITY = 48;
+	private:
+		struct Ops {
+			void (*execute)(void *);
+			void (*undo)(void *);
+			ElectronicDevice *(*device)(void *);
+			void (*relocate)(void *from, void *to);	//move-constructs 'to' and destroys 'from'
+			void (*destroy)(void *);
+		};
+		template<class F, class G> struct Lambdas {
+			F doIt;
+			G undoIt;
+		};
+		struct NoUndo { void operator()() {} };
+		alignas(max_align_t) unsigned char storage[CAPACITY];
+		const Ops *ops;
+
+		//Command implementations are called by their exact type, so there is no virtual call
+		template<class T> static void executeCommand(void *p) { static_cast<T *>(p)->T::execute(); }
+		template<class T> static void undoCommand(void *p) { static_cast<T *>(p)->T::undo(); }
+		template<class T> static ElectronicDevice *deviceOfCommand(void *p) { return static_cast<T *>(p)->T::getDevice(); }
+		template<class T> static void executeLambdas(void *p) { static_cast<T *>(p)->doIt(); }
+		template<class T> static void undoLambdas(void *p) { static_cast<T *>(p)->undoIt(); }
+		static ElectronicDevice *noDevice(void *) { return nullptr; }
+		template<class T> static void relocate(void *from, void *to) {
+			new (to) T(std::move(*static_cast<T *>(from)));
+			static_cast<T *>(from)->~T();
+		}
+		template<class T> static void destroy(void *p) { static_cast<T *>(p)->~T(); }
+
+		template<class T> void store(T &&obj, const Ops *o) {
+			static_assert(sizeof(T) <= CAPACITY, "command too large for InlineCommand");
+			static_assert(alignof(T) <= alignof(max_align_t), "command over-aligned for InlineCommand");
+			new (storage) T(std::move(obj));
+			ops = o;
+		}
+		template<class T> void storeCommand(T &&cmd, true_type) {
+			static const Ops o = { executeCommand<T>, undoCommand<T>, deviceOfCommand<T>, relocate<T>, destroy<T> };
+			store(std::move(cmd), &o);
+		}
+		template<class F> void storeCommand(F &&fn, false_type) {
+			typedef Lambdas<F, NoUndo> L;
+			static const Ops o = { executeLambdas<L>, undoLambdas<L>, noDevice, relocate<L>, destroy<L> };
+			store(L{std::move(fn), NoUndo()}, &o);
+		}
+	public:
+		InlineCommand() : ops(nullptr) {}
+		template<class T, class = typename enable_if<!is_same<typename decay<T>::type, InlineCommand>::value>::type>
+		InlineCommand(T cmd) : ops(nullptr) { storeCommand(std::move(cmd), is_base_of<Command, T>()); }
+		template<class F, class G>
+		InlineCommand(F doIt, G undoIt) : ops(nullptr) {
+			typedef Lambdas<F, G> L;
+			static const Ops o = { executeLambdas<L>, undoLambdas<L>, noDevice, relocate<L>, destroy<L> };
+			store(L{std::move(doIt), std::move(undoIt)}, &o);
+		}
+		InlineCommand(InlineCommand &&other) : ops(other.ops) {
+			if (ops != nullptr)
+				ops->relocate(other.storage, storage);
+			other.ops = nullptr;
+		}
+		InlineCommand &operator=(InlineCommand &&other) {
+			if (this != &other) {
+				reset();
+				if (other.ops != nullptr)
+					other.ops->relocate(other.storage, storage);
+				ops = other.ops;
+				other.ops = nullptr;
+			}
+			return *this;
+		}
+		InlineCommand(const InlineCommand &) = delete;
+		InlineCommand &operator=(const InlineCommand &) = delete;
+		~InlineCommand() { reset(); }
+
+		void reset() { if (ops != nullptr) { ops->destroy(storage); ops = nullptr; } }
+		bool empty() const { return ops == nullptr; }
+		void execute() { ops->execute(storage); }
+		void undo() { ops->undo(storage); }
+		ElectronicDevice *getDevice() { return ops->device(storage); }
+};
+
+
+//Asynchronous invoker: commands are queued and run by a pool of executor threads,
+//so the thread pressing the button does not wait for the device. Each executor has its
+//own lock-free multi-producer/single-consumer queue and every device is always sent to
+//the same executor: commands for one device run in the order they were submitted (undos
+//included), commands for different devices run in parallel. Commands with no single
+//device (TurnItAllOff, BroadcastCommand) may touch devices of every executor: they are
+//queued in all of them as a barrier, run once every executor has reached it, and the
+//executors go on when they are done. Submitted commands must outlive their execution
+class AsyncInvoker {
+	private:
+		struct Barrier {
+			atomic<size_t> arrived;
+			atomic<size_t> leaving;		//the last executor leaving deletes the barrier
+			atomic<bool> done;
+			Barrier(size_t n) : arrived(0), leaving(n), done(false) {}
+		};
+		struct Node {
+			atomic<Node *> next;
+			Command *cmd;
+			bool undo;
+			Barrier *barrier;	//fleet commands only
+			Node(Command *c, bool u = false, Barrier *b = nullptr) : next(nullptr), cmd(c), undo(u), barrier(b) {}
+		};
+		//Vyukov's intrusive MPSC queue: producers swap 'head' and link the old head to the
+		//new node; the consumer follows 'next' from 'tail', which is always a consumed node
+		struct Executor {
+			alignas(64) atomic<Node *> head;
+			alignas(64) Node *tail;
+			atomic<long> pending;
+			atomic<long> executed;	//written by the worker only
+			Node stub;
+			thread worker;
+			Executor() : head(&stub), tail(&stub), pending(0), executed(0), stub(nullptr) {}
+		};
+		vector<unique_ptr<Executor>> executors;
+		atomic<bool> running;
+		mutex fleetLock;	//barriers are queued in the same order in every executor
+		size_t executorFor(Command *cmd) const;
+		void push(Executor &ex, Node *first, Node *last, long count);
+		void enqueue(Command *cmd, bool undo);
+		void run(Executor &ex, Node *node);
+		void work(Executor &ex);
+	public:
+		AsyncInvoker(unsigned int nThreads);
+		~AsyncInvoker();	//runs what is still queued
+		void submit(Command *cmd) { enqueue(cmd, false); }
+		void submit(const vector<Command *> &batch);	//one queue operation per executor involved
+		void submitUndo(Command *cmd) { enqueue(cmd, true); }
+		void waitIdle();	//until everything submitted so far has run
+		vector<long> getExecutedPerExecutor() const;
+};
+AsyncInvoker::AsyncInvoker(unsigned int nThreads) : running(true) {
+	for (unsigned int i=0; i<max(1u, nThreads); ++i)
+		executors.emplace_back(new Executor());
+	for (auto &ex : executors)
+		ex->worker = thread(&AsyncInvoker::work, this, ref(*ex));
+}
+AsyncInvoker::~AsyncInvoker() {
+	waitIdle();
+	running.store(false, memory_order_release);
+	for (auto &ex : executors) {
+		ex->worker.join();
+		if (ex->tail != &ex->stub)
+			delete ex->tail;
+	}
+}
+size_t AsyncInvoker::executorFor(Command *cmd) const {
+	//device addresses are multiples of 8 or 16 (and std::hash may return them as they
+	//are), so the bits are mixed before taking the modulo
+	uint64_t bits = reinterpret_cast<uintptr_t>(cmd->getDevice()) >> 4;
+	return ((bits * 0x9E3779B97F4A7C15ull) >> 32) % executors.size();
+}
+void AsyncInvoker::push(Executor &ex, Node *first, Node *last, long count) {
+	ex.pending.fetch_add(count, memory_order_relaxed);
+	Node *prev = ex.head.exchange(last, memory_order_acq_rel);
+	prev->next.store(first, memory_order_release);
+}
+void AsyncInvoker::enqueue(Command *cmd, bool undo) {
+	if (cmd->getDevice() != nullptr) {
+		Node *node = new Node(cmd, undo);
+		push(*executors[executorFor(cmd)], node, node, 1);
+		return;
+	}
+	lock_guard<mutex> lock(fleetLock);
+	Barrier *barrier = new Barrier(executors.size());
+	for (auto &ex : executors) {
+		Node *node = new Node(cmd, undo, barrier);
+		push(*ex, node, node, 1);
+	}
+}
+void AsyncInvoker::submit(const vector<Command *> &batch) {
+	//chain the commands of each executor, then publish every chain with one exchange; a
+	//fleet command publishes what is chained so far and goes in as a barrier
+	vector<Node *> first(executors.size(), nullptr), last(executors.size(), nullptr);
+	vector<long> count(executors.size(), 0);
+	auto publish = [&]() {
+		for (size_t e=0; e<executors.size(); ++e)
+			if (first[e] != nullptr) {
+				push(*executors[e], first[e], last[e], count[e]);
+				first[e] = last[e] = nullptr;
+				count[e] = 0;
+			}
+	};
+	for (auto cmd : batch) {
+		if (cmd->getDevice() == nullptr) {
+			publish();
+			enqueue(cmd, false);
+			continue;
+		}
+		size_t e = executorFor(cmd);
+		Node *node = new Node(cmd);
+		if (last[e] == nullptr)
+			first[e] = node;
+		else
+			last[e]->next.store(node, memory_order_relaxed);
+		last[e] = node;
+		++count[e];
+	}
+	publish();
+}
+void AsyncInvoker::run(Executor &ex, Node *node) {
+	Barrier *barrier = node->barrier;
+	if (barrier == nullptr) {
+		node->undo ? node->cmd->undo() : node->cmd->execute();
+		ex.executed.store(ex.executed.load(memory_order_relaxed) + 1, memory_order_relaxed);
+		return;
+	}
+	//the last executor to arrive runs the fleet command, the others wait for it
+	if (barrier->arrived.fetch_add(1, memory_order_acq_rel) + 1 == executors.size()) {
+		node->undo ? node->cmd->undo() : node->cmd->execute();
+		ex.executed.store(ex.executed.load(memory_order_relaxed) + 1, memory_order_relaxed);
+		barrier->done.store(true, memory_order_release);
+	} else
+		while (!barrier->done.load(memory_order_acquire))
+			this_thread::yield();
+	if (barrier->leaving.fetch_sub(1, memory_order_acq_rel) == 1)
+		delete barrier;
+}
+void AsyncInvoker::work(Executor &ex) {
+	while (true) {
+		Node *next = ex.tail->next.load(memory_order_acquire);
+		if (next == nullptr) {
+			if (!running.load(memory_order_acquire))
+				return;
+			this_thread::sleep_for(chrono::microseconds(20));	//idle
+			continue;
+		}
+		//drain everything already linked before checking for idleness again
+		do {
+			if (ex.tail != &ex.stub)
+				delete ex.tail;
+			ex.tail = next;
+			run(ex, next);
+			ex.pending.fetch_sub(1, memory_order_release);
+			next = ex.tail->next.load(memory_order_acquire);
+		} while (next != nullptr);
+	}
+}
+vector<long> AsyncInvoker::getExecutedPerExecutor() const {
+	vector<long> executed;
+	for (auto &ex : executors)
+		executed.push_back(ex->executed.load(memory_order_relaxed));
+	return executed;
+}
+void AsyncInvoker::waitIdle() {
+	for (auto &ex : executors)
+		while (ex->pending.load(memory_order_acquire) > 0)
+			this_thread::yield();
+}
+
+//Invoker (runs the command itself, or hands it to an asynchronous invoker)
 class DeviceButton {
 	private:
 		Command *cmd;
+		AsyncInvoker *invoker;
 	public:
-		DeviceButton (Command *c) : cmd(c) {}
-		void press() { cmd->execute(); }
-		void pressUndo() { cmd->undo(); }
+		DeviceButton (Command *c, AsyncInvoker *inv = nullptr) : cmd(c), invoker(inv) {}
+		void press() { if (invoker != nullptr) invoker->submit(cmd); else cmd->execute(); }
+		void pressUndo() { if (invoker != nullptr) invoker->submitUndo(cmd); else cmd->undo(); }
 };
 
 class TVRemote{
@@ -113,31 +428,864 @@ class TVRemote{
 };
 
 
-int main() {
+//Undo/redo history: commands are kept as small plain records (what to do, to which
+//device, how many times) in a fixed ring, instead of a list of heap Command objects.
+//Recording, undoing and redoing are O(1); when the ring is full the oldest record is
+//forgotten, so memory does not grow however long the session runs
+//The history keeps what each command really did (a volume already at 10 ignores
+//VolumeUp, a TV already off ignores Off), so undoing an ignored command does nothing
+enum class Opcode : uint8_t { On, Off, VolumeUp, VolumeDown, AdjustVolume, None };
+struct CommandRecord {
+	Opcode opcode;
+	uint32_t deviceId;	//index in the DeviceTable
+	int32_t arg;		//repetitions for VolumeUp/VolumeDown, signed change for AdjustVolume;
+						//once applied: steps taken, change applied, 1 if On/Off changed the power
+};
+
+class DeviceTable {
+	private:
+		vector<ElectronicDevice *> devices;
+	public:
+		uint32_t add(ElectronicDevice *dev) { devices.push_back(dev); return devices.size() - 1; }
+		ElectronicDevice *operator[](uint32_t id) const { return devices[id]; }
+		uint32_t size() const { return devices.size(); }
+		CommandRecord apply(CommandRecord rec) const;	//returns what was really done
+		static CommandRecord inverse(CommandRecord rec);
+};
+CommandRecord DeviceTable::apply(CommandRecord rec) const {
+	ElectronicDevice *dev = devices[rec.deviceId];
+	bool wasOn = dev->isOn();
+	int volume = dev->getVolume();
+	switch (rec.opcode) {
+		case Opcode::On: dev->on(); rec.arg = !wasOn; break;
+		case Opcode::Off: dev->off(); rec.arg = wasOn; break;
+		case Opcode::VolumeUp:
+			for (int i=0; i<rec.arg; ++i) dev->volumeUp();
+			rec.arg = dev->getVolume() - volume;
+			break;
+		case Opcode::VolumeDown:
+			for (int i=0; i<rec.arg; ++i) dev->volumeDown();
+			rec.arg = volume - dev->getVolume();
+			break;
+		case Opcode::AdjustVolume: rec.arg = dev->adjustVolume(rec.arg); break;	//clamped by the device
+		case Opcode::None: break;
+	}
+	return rec;
+}
+CommandRecord DeviceTable::inverse(CommandRecord rec) {	//rec as returned by apply
+	switch (rec.opcode) {
+		case Opcode::On: rec.opcode = rec.arg ? Opcode::Off : Opcode::None; break;
+		case Opcode::Off: rec.opcode = rec.arg ? Opcode::On : Opcode::None; break;
+		case Opcode::VolumeUp: rec.opcode = Opcode::VolumeDown; break;
+		case Opcode::VolumeDown: rec.opcode = Opcode::VolumeUp; break;
+		case Opcode::AdjustVolume: rec.arg = -rec.arg; break;
+		case Opcode::None: break;
+	}
+	return rec;
+}
+
+
+//Command journal: every command really executed is appended to a memory mapped file,
+//and every snapshotInterval records the volume and power of all devices are saved.
+//Opening an existing journal loads the latest snapshot and replays only the records
+//written after it, on plain DeviceStates, before restoring the devices: startup time
+//depends on the tail, not on the whole history. Snapshots alternate between two
+//slots and the header switches to the new one only once it is complete. Records are
+//not synced to disk one by one, so a power loss may lose the last ones (a crashed
+//process does not). The file is never compacted; older records are just skipped
+//File: JournalHeader, two snapshot slots (SnapshotHeader + deviceCount DeviceStates),
+//then recordCapacity CommandRecords (native endianness)
+struct JournalHeader {
+	char magic[4];			//"CJRN"
+	uint32_t version;
+	uint32_t deviceCount;
+	uint32_t activeSnapshot;	//0 or 1
+	uint64_t recordCount;
+	uint64_t recordCapacity;	//the file grows when it is full
+};
+struct SnapshotHeader {
+	uint64_t firstRecord;	//records before it are included in the snapshot
+};
+struct DeviceState {
+	int32_t volume;
+	uint8_t on;
+	uint8_t reserved[3];
+	void apply(const CommandRecord &rec);	//same rules as the devices (volume 0 to 10)
+};
+void DeviceState::apply(const CommandRecord &rec) {
+	switch (rec.opcode) {
+		case Opcode::On: on = 1; break;
+		case Opcode::Off: on = 0; break;
+		case Opcode::VolumeUp: volume = min(10, volume + rec.arg); break;
+		case Opcode::VolumeDown: volume = max(0, volume - rec.arg); break;
+		case Opcode::AdjustVolume: volume = max(0, min(10, volume + rec.arg)); break;
+		case Opcode::None: break;
+	}
+}
+
+class CommandJournal {
+	private:
+		const DeviceTable &table;
+		uint64_t snapshotInterval;
+		int fd;
+		void *mapping;
+		size_t mappingSize;
+		uint64_t replayedRecords;
+		JournalHeader *header() const { return static_cast<JournalHeader *>(mapping); }
+		size_t slotSize() const { return sizeof(SnapshotHeader) + table.size() * sizeof(DeviceState); }
+		SnapshotHeader *slot(uint32_t i) const;
+		DeviceState *slotStates(uint32_t i) const { return reinterpret_cast<DeviceState *>(slot(i) + 1); }
+		CommandRecord *records() const;
+		size_t fileSize(uint64_t capacity) const { return sizeof(JournalHeader) + 2 * slotSize() + capacity * sizeof(CommandRecord); }
+		bool map(size_t size);
+		bool create();
+		bool recover();
+	public:
+		CommandJournal(const string &path, const DeviceTable &t, uint64_t interval = 65536);
+		~CommandJournal();
+		bool isOpen() const { return mapping != nullptr; }
+		void append(const CommandRecord &rec);	//rec as really executed
+		void snapshot();
+		uint64_t getRecordCount() const { return header()->recordCount; }
+		uint64_t getReplayedRecords() const { return replayedRecords; }	//tail length at startup
+};
+CommandJournal::CommandJournal(const string &path, const DeviceTable &t, uint64_t interval)
+: table(t), snapshotInterval(max<uint64_t>(1, interval)), mapping(nullptr), mappingSize(0), replayedRecords(0) {
+	fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		cerr << "CommandJournal: cannot open " << path << endl;
+		return;
+	}
+	struct stat st;
+	bool existing = fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(JournalHeader);
+	if (existing ? !recover() : !create())
+		cerr << "CommandJournal: " << path << " is not a valid journal for these devices" << endl;
+}
+CommandJournal::~CommandJournal() {
+	if (mapping != nullptr)
+		munmap(mapping, mappingSize);
+	if (fd >= 0)
+		close(fd);
+}
+SnapshotHeader *CommandJournal::slot(uint32_t i) const {
+	return reinterpret_cast<SnapshotHeader *>(static_cast<char *>(mapping) + sizeof(JournalHeader) + i * slotSize());
+}
+CommandRecord *CommandJournal::records() const {
+	return reinterpret_cast<CommandRecord *>(static_cast<char *>(mapping) + sizeof(JournalHeader) + 2 * slotSize());
+}
+bool CommandJournal::map(size_t size) {
+	if (mapping != nullptr)
+		munmap(mapping, mappingSize);
+	mapping = nullptr;
+	if (ftruncate(fd, size) != 0)
+		return false;
+	void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		return false;
+	mapping = addr;
+	mappingSize = size;
+	return true;
+}
+bool CommandJournal::create() {
+	if (!map(fileSize(snapshotInterval)))
+		return false;
+	*header() = {{'C', 'J', 'R', 'N'}, 1, table.size(), 0, 0, snapshotInterval};
+	snapshot();
+	return true;
+}
+bool CommandJournal::recover() {
+	struct stat st;
+	fstat(fd, &st);
+	JournalHeader h;
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, "CJRN", 4) != 0 || h.version != 1
+		|| h.deviceCount != table.size() || h.activeSnapshot > 1 || h.recordCount > h.recordCapacity
+		|| size_t(st.st_size) < fileSize(h.recordCapacity))
+		return false;
+	if (!map(fileSize(h.recordCapacity)))
+		return false;
+
+	//latest snapshot plus the records written after it
+	vector<DeviceState> states(slotStates(h.activeSnapshot), slotStates(h.activeSnapshot) + table.size());
+	const CommandRecord *recs = records();
+	for (uint64_t i=slot(h.activeSnapshot)->firstRecord; i<h.recordCount; ++i)
+		if (recs[i].deviceId < states.size())
+			states[recs[i].deviceId].apply(recs[i]);
+	replayedRecords = h.recordCount - slot(h.activeSnapshot)->firstRecord;
+	for (uint32_t id=0; id<table.size(); ++id)
+		table[id]->restoreState(states[id].volume, states[id].on != 0);
+	return true;
+}
+void CommandJournal::append(const CommandRecord &rec) {
+	if (mapping == nullptr)
+		return;
+	JournalHeader *h = header();
+	if (h->recordCount == h->recordCapacity) {
+		uint64_t capacity = h->recordCapacity * 2;
+		if (!map(fileSize(capacity))) {
+			cerr << "CommandJournal: cannot grow the journal" << endl;
+			return;
+		}
+		h = header();
+		h->recordCapacity = capacity;
+	}
+	records()[h->recordCount] = rec;
+	++h->recordCount;
+	if (h->recordCount - slot(h->activeSnapshot)->firstRecord >= snapshotInterval)
+		snapshot();
+}
+void CommandJournal::snapshot() {
+	JournalHeader *h = header();
+	uint32_t next = h->activeSnapshot ^ 1;
+	if (h->recordCount == 0)
+		next = 0;	//new journal
+	DeviceState *states = slotStates(next);
+	for (uint32_t id=0; id<table.size(); ++id)
+		states[id] = {int32_t(table[id]->getVolume()), uint8_t(table[id]->isOn()), {0, 0, 0}};
+	slot(next)->firstRecord = h->recordCount;
+	atomic_thread_fence(memory_order_release);
+	h->activeSnapshot = next;
+	msync(mapping, mappingSize, MS_ASYNC);
+}
+
+template<size_t CAPACITY>	//power of two
+class CommandHistory {
+	private:
+		static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+		array<CommandRecord, CAPACITY> records;
+		const DeviceTable &table;
+		size_t oldest = 0;		//position of the oldest undoable record
+		size_t undoable = 0;	//records before the cursor
+		size_t redoable = 0;	//undone records after the cursor
+		CommandJournal *journal = nullptr;
+		CommandRecord &at(size_t i) { return records[(oldest + i) & (CAPACITY - 1)]; }
+		CommandRecord apply(const CommandRecord &rec);
+	public:
+		CommandHistory(const DeviceTable &t) : table(t) {}
+		void setJournal(CommandJournal *j) { journal = j; }	//also journals undo and redo
+		void execute(const CommandRecord &rec);	//runs it and drops whatever could be redone
+		bool undo();
+		bool redo();
+		size_t undoCount() const { return undoable; }
+		size_t redoCount() const { return redoable; }
+};
+template<size_t CAPACITY>
+CommandRecord CommandHistory<CAPACITY>::apply(const CommandRecord &rec) {
+	CommandRecord done = table.apply(rec);
+	if (journal != nullptr)
+		journal->append(done);
+	return done;
+}
+template<size_t CAPACITY>
+void CommandHistory<CAPACITY>::execute(const CommandRecord &rec) {
+	at(undoable) = apply(rec);
+	if (undoable < CAPACITY)
+		++undoable;
+	else
+		oldest = (oldest + 1) & (CAPACITY - 1);
+	redoable = 0;
+}
+template<size_t CAPACITY>
+bool CommandHistory<CAPACITY>::undo() {
+	if (undoable == 0)
+		return false;
+	--undoable;
+	++redoable;
+	apply(DeviceTable::inverse(at(undoable)));
+	return true;
+}
+template<size_t CAPACITY>
+bool CommandHistory<CAPACITY>::redo() {
+	if (redoable == 0)
+		return false;
+	at(undoable) = apply(at(undoable));	//what the redo really did, for the next undo
+	++undoable;
+	--redoable;
+	return true;
+}
+
+//Coalescing stage in front of the history: presses are buffered and a run of volume
+//presses on the same device in the same direction becomes one AdjustVolume, so the
+//device is called (and prints) once. Runs are not merged across a change of direction:
+//with the volume clamped at 0 and 10, up-then-down is not the same as doing nothing.
+//Every volume press, merged or not, becomes an AdjustVolume: the history then records
+//the change the device really applied, and each run is undone in one step
+class CommandCoalescer {
+	private:
+		vector<CommandRecord> pending;
+		static int volumeDelta(const CommandRecord &rec);
+	public:
+		void press(const CommandRecord &rec);
+		template<size_t CAPACITY> size_t flush(CommandHistory<CAPACITY> &history);	//returns the records executed
+};
+int CommandCoalescer::volumeDelta(const CommandRecord &rec) {
+	switch (rec.opcode) {
+		case Opcode::VolumeUp: return rec.arg;
+		case Opcode::VolumeDown: return -rec.arg;
+		case Opcode::AdjustVolume: return rec.arg;
+		default: return 0;
+	}
+}
+void CommandCoalescer::press(const CommandRecord &rec) {
+	int delta = volumeDelta(rec);
+	if (delta == 0) {
+		pending.push_back(rec);
+		return;
+	}
+	if (!pending.empty()) {
+		CommandRecord &last = pending.back();
+		int lastDelta = volumeDelta(last);
+		if (last.deviceId == rec.deviceId && lastDelta != 0 && (lastDelta > 0) == (delta > 0)) {
+			last.arg = lastDelta + delta;
+			return;
+		}
+	}
+	pending.push_back({Opcode::AdjustVolume, rec.deviceId, delta});
+}
+template<size_t CAPACITY>
+size_t CommandCoalescer::flush(CommandHistory<CAPACITY> &history) {
+	for (auto &rec : pending)
+		history.execute(rec);
+	size_t executed = pending.size();
+	pending.clear();
+	return executed;
+}
+
+
+//Broadcast command: the same record sent to every device of a DeviceTable, in parallel.
+//The ids are split in one contiguous range per thread; each thread takes chunks of its
+//range through an atomic cursor and, when it is done, steals chunks from the others, so
+//slow devices do not leave threads idle. The state of each device before the command is
+//kept, and undo only sends what is needed to bring every device back to it
+struct BroadcastReport {
+	size_t devices;
+	size_t chunksStolen;
+	double milliseconds;
+	vector<size_t> devicesPerThread;
+};
+
+class BroadcastCommand : public Command {
+	private:
+		static const size_t CHUNK = 256;
+		struct alignas(64) Range {
+			atomic<size_t> next;
+			size_t end;
+		};
+		const DeviceTable &table;
+		CommandRecord rec;		//deviceId is ignored
+		unsigned int nThreads;
+		vector<DeviceState> before;
+		BroadcastReport report;
+		function<void(const BroadcastReport &)> onCompletion;
+		void run(const function<void(uint32_t)> &action);
+	public:
+		BroadcastCommand(const DeviceTable &t, CommandRecord r, unsigned int threads,
+						 function<void(const BroadcastReport &)> done = nullptr)
+		: table(t), rec(r), nThreads(max(1u, threads)), report{0, 0, 0, {}}, onCompletion(done) {}
+		void execute();
+		void undo();
+		const BroadcastReport &getReport() const { return report; }	//of the last execute or undo
+};
+void BroadcastCommand::run(const function<void(uint32_t)> &action) {
+	size_t n = table.size();
+	vector<Range> ranges(nThreads);
+	for (unsigned int t=0; t<nThreads; ++t) {
+		ranges[t].next.store(n * t / nThreads, memory_order_relaxed);
+		ranges[t].end = n * (t + 1) / nThreads;
+	}
+	report = {n, 0, 0, vector<size_t>(nThreads, 0)};
+	atomic<size_t> stolen(0);
+
+	auto worker = [&](unsigned int self) {
+		size_t done = 0, steals = 0;
+		for (unsigned int k=0; k<nThreads; ++k) {	//own range first, then the others
+			Range &range = ranges[(self + k) % nThreads];
+			while (true) {
+				size_t begin = range.next.fetch_add(CHUNK, memory_order_relaxed);
+				if (begin >= range.end)
+					break;
+				size_t end = min(begin + CHUNK, range.end);
+				for (size_t id=begin; id<end; ++id)
+					action(id);
+				done += end - begin;
+				steals += k > 0;
+			}
+		}
+		report.devicesPerThread[self] = done;
+		stolen.fetch_add(steals, memory_order_relaxed);
+	};
+	auto start = chrono::steady_clock::now();
+	vector<thread> threads;
+	for (unsigned int t=1; t<nThreads; ++t)
+		threads.emplace_back(worker, t);
+	worker(0);	//the calling thread works too
+	for (auto &t : threads)
+		t.join();
+	report.milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	report.chunksStolen = stolen;
+	if (onCompletion)
+		onCompletion(report);
+}
+void BroadcastCommand::execute() {
+	before.resize(table.size());
+	run([this](uint32_t id) {
+		ElectronicDevice *dev = table[id];
+		before[id] = {int32_t(dev->getVolume()), uint8_t(dev->isOn()), {0, 0, 0}};
+		CommandRecord r = rec;
+		r.deviceId = id;
+		table.apply(r);
+	});
+}
+void BroadcastCommand::undo() {
+	run([this](uint32_t id) {
+		if (id >= before.size())
+			return;	//added after execute
+		ElectronicDevice *dev = table[id];
+		if (dev->isOn() != (before[id].on != 0)) {
+			if (before[id].on)
+				dev->on();
+			else
+				dev->off();
+		}
+		if (dev->getVolume() != before[id].volume)
+			dev->adjustVolume(before[id].volume - dev->getVolume());
+	});
+}
+
+
+//BENCHMARK (run with --bench): 4 producer threads submit 1M volume commands to 4096
+//devices that only count them, one by one and in batches of 64
+class SilentDevice : public ElectronicDevice {
+	public:
+		long actions = 0;	//only touched by the executor owning this device
+		int volume = 0;
+		bool power = false;
+		virtual void on() { ++actions; power = true; }
+		virtual void off() { ++actions; power = false; }
+		virtual void volumeUp() { ++actions; if (volume < 10) ++volume; }
+		virtual void volumeDown() { ++actions; if (volume > 0) --volume; }
+		virtual int getVolume() const { return volume; }
+		virtual bool isOn() const { return power; }
+		virtual void restoreState(int vol, bool pwr) { volume = vol; power = pwr; }
+};
+
+void runAsyncInvokerBenchmark() {
+	const int nDevices = 4096, nProducers = 4, perProducer = 250000, batchSize = 64;
+	unsigned int nExecutors = max(2u, thread::hardware_concurrency());
+	vector<SilentDevice> devices(nDevices);
+	vector<unique_ptr<Command>> commands;
+	for (auto &dev : devices)
+		commands.emplace_back(new TurnTVUp(&dev));
+
+	for (int batched=0; batched<2; ++batched) {
+		for (auto &dev : devices)
+			dev.actions = 0;
+		vector<vector<float>> latencies(nProducers);
+		AsyncInvoker invoker(nExecutors);
+		auto start = chrono::steady_clock::now();
+		vector<thread> producers;
+		for (int p=0; p<nProducers; ++p)
+			producers.emplace_back([&, p]() {
+				unsigned int r = p + 1;
+				vector<Command *> batch;
+				for (int i=0; i<perProducer; ++i) {
+					r = r * 1103515245 + 12345;
+					Command *cmd = commands[(r >> 8) % nDevices].get();
+					if (!batched) {
+						auto t0 = chrono::steady_clock::now();
+						invoker.submit(cmd);
+						if (i % 64 == 0)
+							latencies[p].push_back(chrono::duration<float, nano>(chrono::steady_clock::now() - t0).count());
+						continue;
+					}
+					batch.push_back(cmd);
+					if (batch.size() == batchSize) {
+						auto t0 = chrono::steady_clock::now();
+						invoker.submit(batch);
+						latencies[p].push_back(chrono::duration<float, nano>(chrono::steady_clock::now() - t0).count() / batchSize);
+						batch.clear();
+					}
+				}
+				invoker.submit(batch);
+			});
+		for (auto &t : producers)
+			t.join();
+		invoker.waitIdle();
+		double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		vector<float> all;
+		for (auto &l : latencies)
+			all.insert(all.end(), l.begin(), l.end());
+		sort(all.begin(), all.end());
+		long executed = 0;
+		for (auto &dev : devices)
+			executed += dev.actions;
+		cout << (batched ? "Batches of 64: " : "One by one:    ") << nProducers * perProducer / secs / 1e6 << " M commands/s with "
+			 << nExecutors << " executors; enqueue ns/command p50 " << all[all.size() / 2] << ", p99 "
+			 << all[all.size() * 99 / 100] << "; executed " << executed << " (per executor:";
+		for (long n : invoker.getExecutedPerExecutor())
+			cout << " " << n;
+		cout << ")" << endl;
+	}
+}
+
+//BENCHMARK (run with --bench): 1M button presses, each creating a command, running it
+//and keeping it in a 64-entry undo history; heap allocations are counted by replacing
+//the global operator new (kept out of line so GCC does not report the malloc/free pair
+//as mismatched; it may still elide the short-lived DeviceButton allocation)
+static atomic<long> allocationCount(0);
+__attribute__((noinline)) void *operator new(size_t size) {
+	allocationCount.fetch_add(1, memory_order_relaxed);
+	if (void *p = malloc(size))
+		return p;
+	throw bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { free(p); }
+
+void runInlineCommandBenchmark() {
+	const int presses = 1000000, historySize = 64;
+	SilentDevice dev;
+
+	auto report = [&](const char *name, chrono::steady_clock::time_point start, long allocations) {
+		double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << name << presses / secs / 1e6 << " M presses/s, " << allocationCount - allocations
+			 << " allocations (device actions " << dev.actions << ")" << endl;
+		dev.actions = 0;
+	};
+
+	{
+		vector<Command *> history(historySize, nullptr);
+		long allocations = allocationCount;
+		auto start = chrono::steady_clock::now();
+		for (int i=0; i<presses; ++i) {
+			Command *cmd = (i & 1) ? (Command *) new TurnTVDown(&dev) : (Command *) new TurnTVUp(&dev);
+			DeviceButton *button = new DeviceButton(cmd);
+			button->press();
+			delete button;
+			delete history[i % historySize];
+			history[i % historySize] = cmd;
+		}
+		report("Command* + new:        ", start, allocations);
+		for (auto cmd : history)
+			delete cmd;
+	}
+	{
+		vector<InlineCommand> history(historySize);
+		long allocations = allocationCount;
+		auto start = chrono::steady_clock::now();
+		for (int i=0; i<presses; ++i) {
+			InlineCommand cmd = (i & 1) ? InlineCommand(TurnTVDown(&dev)) : InlineCommand(TurnTVUp(&dev));
+			cmd.execute();
+			history[i % historySize] = std::move(cmd);
+		}
+		report("InlineCommand:         ", start, allocations);
+	}
+	{
+		vector<InlineCommand> history(historySize);
+		long allocations = allocationCount;
+		auto start = chrono::steady_clock::now();
+		for (int i=0; i<presses; ++i) {
+			SilentDevice *d = &dev;
+			InlineCommand cmd = (i & 1) ? InlineCommand([d]() { d->volumeDown(); }, [d]() { d->volumeUp(); })
+										: InlineCommand([d]() { d->volumeUp(); }, [d]() { d->volumeDown(); });
+			cmd.execute();
+			history[i % historySize] = std::move(cmd);
+		}
+		report("InlineCommand (lambda):", start, allocations);
+	}
+}
+
+//BENCHMARK (run with --bench): 10M operations on 1024 devices, one undo every 4
+//commands and one redo every 8, with the record ring against a list of heap commands
+void runHistoryBenchmark() {
+	const int nDevices = 1024, operations = 10000000;
+	vector<SilentDevice> devices(nDevices);
+	DeviceTable table;
+	for (auto &dev : devices)
+		table.add(&dev);
+
+	{
+		CommandHistory<4096> *history = new CommandHistory<4096>(table);
+		long allocations = allocationCount;
+		auto start = chrono::steady_clock::now();
+		for (int i=0; i<operations; ++i) {
+			if (i % 4 == 3)
+				history->undo();
+			else if (i % 8 == 6)
+				history->redo();
+			else
+				history->execute({(i & 1) ? Opcode::VolumeDown : Opcode::VolumeUp, uint32_t(i % nDevices), 1});
+		}
+		double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << "Record ring:   " << secs / operations * 1e9 << " ns/operation, " << sizeof(*history)
+			 << " bytes, " << allocationCount - allocations << " allocations" << endl;
+		delete history;
+	}
+	{
+		list<Command *> done, undone;
+		long allocations = allocationCount;
+		auto start = chrono::steady_clock::now();
+		for (int i=0; i<operations; ++i) {
+			if (i % 4 == 3) {
+				if (!done.empty()) {
+					done.back()->undo();
+					undone.push_back(done.back());
+					done.pop_back();
+				}
+			} else if (i % 8 == 6) {
+				if (!undone.empty()) {
+					undone.back()->execute();
+					done.push_back(undone.back());
+					undone.pop_back();
+				}
+			} else {
+				Command *cmd = (i & 1) ? (Command *) new TurnTVDown(&devices[i % nDevices]) : (Command *) new TurnTVUp(&devices[i % nDevices]);
+				cmd->execute();
+				done.push_back(cmd);
+				for (auto c : undone)
+					delete c;
+				undone.clear();
+			}
+		}
+		double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << "Command* list: " << secs / operations * 1e9 << " ns/operation, " << done.size()
+			 << " commands kept, " << allocationCount - allocations << " allocations" << endl;
+		for (auto c : done)
+			delete c;
+		for (auto c : undone)
+			delete c;
+	}
+}
+
+//BENCHMARK (run with --bench): 1M volume presses on a Television, in runs of 8 presses
+//in the same direction, executed one by one or through the coalescer (the log is sent
+//to /dev/null, each device call is still one log event)
+void runCoalescingBenchmark() {
+	const int presses = 1000000, runLength = 8;
+	FILE *sink = fopen("/dev/null", "w");
+	LogSink::Logger::instance().setOutput(sink);
+	double secs[2];
+	size_t calls[2];
+	for (int coalesce=0; coalesce<2; ++coalesce) {
+		Television tv;
+		DeviceTable table;
+		uint32_t id = table.add(&tv);
+		CommandHistory<1024> history(table);
+		CommandCoalescer coalescer;
+		calls[coalesce] = 0;
+		auto start = chrono::steady_clock::now();
+		for (int i=0; i<presses; ++i) {
+			CommandRecord rec = {(i / runLength) & 1 ? Opcode::VolumeDown : Opcode::VolumeUp, id, 1};
+			if (coalesce)
+				coalescer.press(rec);
+			else {
+				history.execute(rec);
+				++calls[coalesce];
+			}
+			if (coalesce && i % 64 == 63)	//flush every 64 presses
+				calls[coalesce] += coalescer.flush(history);
+		}
+		calls[coalesce] += coalescer.flush(history);
+		secs[coalesce] = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+	LogSink::Logger::instance().setOutput(stdout);
+	fclose(sink);
+	cout << "One by one: " << presses / secs[0] / 1e6 << " M presses/s, " << calls[0] << " device calls" << endl;
+	cout << "Coalesced:  " << presses / secs[1] / 1e6 << " M presses/s, " << calls[1] << " device calls" << endl;
+}
+
+//BENCHMARK (run with --bench): journals of 1M to 16M records over 1024 devices, startup
+//time (open, load snapshot, replay tail) with a snapshot every 64K records compared to
+//replaying the whole journal
+void runJournalBenchmark() {
+	const int nDevices = 1024;
+	const char *path = "dp_command_journal_bench.bin";
+	vector<SilentDevice> devices(nDevices);
+	DeviceTable table;
+	for (auto &dev : devices)
+		table.add(&dev);
+
+	for (uint64_t total : {1000000u, 4000000u, 16000000u}) {
+		for (uint64_t interval : {uint64_t(65536), total + 1}) {
+			remove(path);
+			double appendNs;
+			{
+				CommandJournal journal(path, table, interval);
+				unsigned int r = 1;
+				auto start = chrono::steady_clock::now();
+				for (uint64_t i=0; i<total; ++i) {
+					r = r * 1103515245 + 12345;
+					CommandRecord rec = {Opcode((r >> 16) % 5), (r >> 4) % nDevices, 1};
+					journal.append(table.apply(rec));
+				}
+				appendNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / total;
+			}
+			vector<int> expected;
+			for (auto &dev : devices) {
+				expected.push_back(dev.volume * 2 + dev.power);
+				dev.restoreState(0, false);
+			}
+
+			auto start = chrono::steady_clock::now();
+			CommandJournal journal(path, table, interval);
+			double startupMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+			bool restored = true;
+			for (int i=0; i<nDevices; ++i)
+				restored = restored && expected[i] == devices[i].volume * 2 + devices[i].power;
+			cout << total << " records, " << (interval > total ? "no snapshot:   " : "snapshots/64K: ")
+				 << appendNs << " ns/append, startup " << startupMs << " ms replaying "
+				 << journal.getReplayedRecords() << " records" << (restored ? "" : " (STATE MISMATCH)") << endl;
+		}
+	}
+	remove(path);
+}
+
+//BENCHMARK (run with --bench): 50000 devices turned off, first by TurnItAllOff and then
+//by BroadcastCommand with 1 to 8 threads, and turned back on by its undo; devices in the
+//first eighth of the table are 20 times slower, which is where stealing pays off
+class FleetDevice : public SilentDevice {
+	public:
+		int cost = 50;
+		void work() { for (volatile int i=0; i<cost; ++i) {} }
+		virtual void on() { work(); SilentDevice::on(); }
+		virtual void off() { work(); SilentDevice::off(); }
+};
+
+void runBroadcastBenchmark() {
+	const int nDevices = 50000;
+	vector<FleetDevice> devices(nDevices);
+	DeviceTable table;
+	list<ElectronicDevice *> devList;
+	for (int i=0; i<nDevices; ++i) {
+		devices[i].cost = i < nDevices / 8 ? 1000 : 50;
+		devices[i].power = i % 3 != 0;	//a third of them is already off
+		table.add(&devices[i]);
+		devList.push_back(&devices[i]);
+	}
+	auto countOn = [&]() { int on = 0; for (auto &dev : devices) on += dev.power; return on; };
+	int initiallyOn = countOn();
+
+	TurnItAllOff serial(devList);
+	auto start = chrono::steady_clock::now();
+	serial.execute();
+	cout << "TurnItAllOff:           " << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()
+		 << " ms, " << countOn() << " devices on" << endl;
+
+	for (unsigned int nThreads : {1u, 2u, 4u, 8u}) {
+		for (int i=0; i<nDevices; ++i)
+			devices[i].power = i % 3 != 0;
+		BroadcastCommand allOff(table, {Opcode::Off, 0, 0}, nThreads);
+		allOff.execute();
+		BroadcastReport report = allOff.getReport();
+		int onAfter = countOn();
+		allOff.undo();
+		cout << "Broadcast, " << nThreads << " thread(s): " << report.milliseconds << " ms, " << onAfter
+			 << " devices on, " << report.chunksStolen << " chunks stolen; undo " << allOff.getReport().milliseconds
+			 << " ms, " << countOn() << "/" << initiallyOn << " back on" << endl;
+	}
+}
+
+int main(int argc, char *argv[]) {
+
+	if (argc > 1 && string(argv[1]) == "--bench") {
+		runAsyncInvokerBenchmark();
+		runInlineCommandBenchmark();
+		runHistoryBenchmark();
+		runCoalescingBenchmark();
+		runJournalBenchmark();
+		runBroadcastBenchmark();
+		return 0;
+	}
 
 	TVRemote *tv = new TVRemote();
 	ElectronicDevice *dev = tv->getDevice();
 
-	cout << "Turning TV on..." << endl;
+	LogSink::log("Turning TV on...");
 	TurnTVOn *cmdON = new TurnTVOn(dev);
 	DeviceButton *onPressed = new DeviceButton(cmdON);
 	onPressed->press();
 	delete cmdON;
 	delete onPressed;
 
-	cout << "Turning TV volume up..." << endl;
+	LogSink::log("Turning TV volume up...");
 	TurnTVUp *cmdUP = new TurnTVUp(dev);
 	onPressed = new DeviceButton(cmdUP);
 	onPressed->press();
 	onPressed->press();
 	onPressed->press();
 	onPressed->press();
-	cout << "Turning TV volume up using undo..." << endl;
+	LogSink::log("Turning TV volume up using undo...");
 	onPressed->pressUndo();
 	delete cmdUP;
 	delete onPressed;
 
-	cout << "Turning all devices off..." << endl;
+	LogSink::log("Turning TV volume down through the asynchronous invoker...");
+	AsyncInvoker *invoker = new AsyncInvoker(2);
+	TurnTVDown *cmdDOWN = new TurnTVDown(dev);
+	onPressed = new DeviceButton(cmdDOWN, invoker);
+	onPressed->press();
+	onPressed->press();
+	invoker->waitIdle();
+	delete cmdDOWN;
+	delete onPressed;
+	delete invoker;
+
+	LogSink::log("Turning TV volume up and down with inline commands and a history...");
+	vector<InlineCommand> history;
+	history.push_back(TurnTVUp(dev));
+	history.push_back(InlineCommand([dev]() { dev->volumeUp(); dev->volumeUp(); },
+									[dev]() { dev->volumeDown(); dev->volumeDown(); }));
+	for (auto &cmd : history)
+		cmd.execute();
+	while (!history.empty()) {
+		history.back().undo();
+		history.pop_back();
+	}
+
+	LogSink::log("Using the undo/redo history...");
+	DeviceTable table;
+	uint32_t tvId = table.add(dev);
+	CommandHistory<16> remote(table);
+	remote.execute({Opcode::VolumeUp, tvId, 2});
+	remote.execute({Opcode::Off, tvId, 0});
+	remote.undo();
+	remote.undo();
+	remote.redo();
+
+	LogSink::log("Pressing volume up 3 times and down 2 times through the coalescer...");
+	CommandCoalescer coalescer;
+	for (int i=0; i<3; ++i)
+		coalescer.press({Opcode::VolumeUp, tvId, 1});
+	for (int i=0; i<2; ++i)
+		coalescer.press({Opcode::VolumeDown, tvId, 1});
+	coalescer.flush(remote);
+	remote.undo();
+	remote.undo();
+
+	LogSink::log("Journaling the TV commands, then restoring a new TV from the journal...");
+	remove("dp_command_journal.bin");
+	{
+		CommandJournal journal("dp_command_journal.bin", table, 4);
+		remote.setJournal(&journal);
+		remote.execute({Opcode::On, tvId, 0});
+		remote.execute({Opcode::AdjustVolume, tvId, 5});
+		remote.undo();
+		remote.redo();
+		remote.execute({Opcode::VolumeDown, tvId, 1});
+		remote.setJournal(nullptr);
+	}
+	{
+		Television restoredTV;
+		DeviceTable restoredTable;
+		restoredTable.add(&restoredTV);
+		CommandJournal journal("dp_command_journal.bin", restoredTable, 4);
+		LogSink::log(restoredTV.isOn() ? "\tRestored TV: volume = %ld, on (%ld of %ld records replayed)"
+									   : "\tRestored TV: volume = %ld, off (%ld of %ld records replayed)",
+					 restoredTV.getVolume(), journal.getReplayedRecords(), journal.getRecordCount());
+	}
+	remove("dp_command_journal.bin");
+
+	LogSink::log("Turning all devices off...");
 	list<ElectronicDevice *> devices;
 	devices.push_back(new Radio());
 	devices.push_back(new Television());
@@ -145,12 +1293,31 @@ int main() {
 	onPressed = new DeviceButton(cmdTIAO);
 	onPressed->press();
 	delete cmdTIAO;
+	delete onPressed;
+
+	LogSink::log("Turning the TV on, then all devices off and back on in parallel...");
+	DeviceTable fleet;
+	for (auto d : devices)
+		fleet.add(d);
+	fleet.add(dev);
+	dev->on();
+	BroadcastCommand *cmdBroadcast = new BroadcastCommand(fleet, {Opcode::Off, 0, 0}, 2, [](const BroadcastReport &r) {
+		LogSink::log("\tBroadcast done on %ld devices", r.devices);
+	});
+	onPressed = new DeviceButton(cmdBroadcast);
+	onPressed->press();
+	onPressed->pressUndo();	//only the TV was on
+	delete cmdBroadcast;
+	delete onPressed;
+	for (auto d : devices)
+		delete d;
 
 	delete tv;
 	delete dev;
 
 
-	cout << "END OF PROGRAM" << endl; // prints END OF PROGRAM
+	LogSink::log("END OF PROGRAM"); // prints END OF PROGRAM
+	LogSink::flush();
 	return 0;
 }
 
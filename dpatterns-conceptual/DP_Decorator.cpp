@@ -14,6 +14,15 @@
 //============================================================================
 
 #include <iostream>
+#include <string>
+#include <chrono>
+#include <vector>
+#include <string_view>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <cstdlib>
+#include <cstdint>
 using namespace std;
 
 //Let's say we have a pizza shop and we need very easy to add tops in the pizzas
@@ -47,19 +56,44 @@ namespace Attemp1 {
 
 namespace Attempt2 {
 
+	//The description is written into one buffer: a first walk down the chain adds up the
+	//length of each layer's part, then the buffer is sized once and every layer copies its
+	//part into place, from the outer layer (the end of the text) to the dough. Both walks
+	//are loops, so deep chains do not recurse and no layer builds a temporary string
 	class Pizza {
 		public:
 			virtual ~Pizza() {}
-			virtual string getDescription () = 0;
+			virtual string getDescription () { string description; appendDescription(description); return description; }
+			void appendDescription(string &out);
+			size_t descriptionLength();
 			virtual double getCost() = 0;
+			virtual string_view getPart() = 0;				//this layer's words only
+			virtual double getPartCost() = 0;				//this layer's price only
+			virtual Pizza *getInner() { return nullptr; }	//next layer down, none for the dough
 	};
+	inline size_t Pizza::descriptionLength() {
+		size_t length = 0;
+		for (Pizza *p=this; p!=nullptr; p=p->getInner())
+			length += p->getPart().size();
+		return length;
+	}
+	inline void Pizza::appendDescription(string &out) {
+		size_t end = out.size() + descriptionLength();
+		out.resize(end);
+		for (Pizza *p=this; p!=nullptr; p=p->getInner()) {
+			string_view part = p->getPart();
+			end -= part.size();
+			memcpy(&out[end], part.data(), part.size());
+		}
+	}
 	class PlainPizza : public Pizza {
 		//private:
 			//string description = "Thin Dough";
 			//double cost = 4.0;
 		public:
 			PlainPizza () { cout << "Adding dough" << endl; }
-			string getDescription () { return "Thin Dough"; }
+			string_view getPart() { return "Thin Dough"; }
+			double getPartCost() { return 4.00; }
 			double getCost() { return 4.00; }
 	};
 
@@ -68,7 +102,9 @@ namespace Attempt2 {
 			Pizza *tempPizza;
 		public:
 			ToppingDecorator (Pizza *p) : tempPizza(p) { }
-			string getDescription() { return tempPizza->getDescription(); }
+			string_view getPart() { return ""; }
+			double getPartCost() { return 0; }
+			Pizza *getInner() { return tempPizza; }
 			double getCost() { return tempPizza->getCost(); }
 
 	};
@@ -76,36 +112,424 @@ namespace Attempt2 {
 	class Mozzarella : public ToppingDecorator {
 		public:
 			Mozzarella (Pizza *p) : ToppingDecorator(p) { cout << "Adding mozzarella" << endl; }
-			string getDescription() { return tempPizza->getDescription() + ", Mozzarella"; }
+			string_view getPart() { return ", Mozzarella"; }
+			double getPartCost() { return 1.50; }
 			double getCost() { return tempPizza->getCost() + 1.50; }
 	};
 
 	class TomatoSauce : public ToppingDecorator {
 		public:
 			TomatoSauce (Pizza *p) : ToppingDecorator(p) { cout << "Adding tomato sauce" << endl; }
-			string getDescription() { return tempPizza->getDescription() + ", Tomato Sauce"; }
+			string_view getPart() { return ", Tomato Sauce"; }
+			double getPartCost() { return 0.80; }
 			double getCost() { return tempPizza->getCost() + 0.80; }
 	};
 
+
+	//A frozen pizza is a decorator chain compiled into a flat list of its layers (dough
+	//first), with the total cost and the description computed once from the live chain,
+	//so they are exactly what the chain returns. Later queries do not walk anything and
+	//the frozen pizza does not depend on the chain, which can be deleted
+	class FrozenPizza : public Pizza {
+		public:
+			struct Topping {
+				string name;
+				double cost;
+			};
+		private:
+			vector<Topping> toppings;
+			string description;
+			double cost;
+		public:
+			explicit FrozenPizza(Pizza *live);
+			string getDescription() { return description; }
+			double getCost() { return cost; }
+			string_view getPart() { return description; }	//the whole pizza is one layer now
+			double getPartCost() { return cost; }
+			const vector<Topping> &getToppings() const { return toppings; }
+	};
+	inline FrozenPizza::FrozenPizza(Pizza *live) : cost(live->getCost()) {
+		for (Pizza *p=live; p!=nullptr; p=p->getInner()) {
+			string_view name = p->getPart();
+			if (name.substr(0, 2) == ", ")
+				name.remove_prefix(2);	//separator, only needed in the description
+			if (!name.empty() || p->getPartCost() != 0)
+				toppings.push_back({string(name), p->getPartCost()});
+		}
+		reverse(toppings.begin(), toppings.end());
+		live->appendDescription(description);
+	}
+	inline FrozenPizza freeze(Pizza *live) { return FrozenPizza(live); }
+
+	//The decorators do not own their inner pizza, so deleting the outer layer leaks the
+	//others. An order can instead build its chains in a bump arena: every layer is placed
+	//right after the previous one in the same block and reset() (or the destructor) ends
+	//them all at once: each layer's destructor is called and the memory is taken back by
+	//moving the cursor to the start. Blocks are kept for the next order; a new one is
+	//only allocated when an order does not fit in the ones already there
+	class PizzaArena {
+		private:
+			struct Block {
+				Block *next;
+				size_t size;
+				unsigned char *data() { return reinterpret_cast<unsigned char *>(this + 1); }
+			};
+			struct Cleanup {	//destructor to call at reset, kept in the arena too
+				void (*destroy)(void *);
+				void *object;
+				Cleanup *next;
+			};
+			Block *first;
+			Block *current;
+			size_t used;		//in the current block
+			size_t blockSize;
+			Cleanup *cleanups;	//last made first
+			void *allocate(size_t size, size_t alignment);
+			template<class T> static void destroy(void *p) { static_cast<T *>(p)->~T(); }
+		public:
+			explicit PizzaArena(size_t blockBytes = 4096);
+			~PizzaArena();
+			PizzaArena(const PizzaArena &) = delete;
+			PizzaArena &operator=(const PizzaArena &) = delete;
+			template<class T, class... Args> T *make(Args&&... args);
+			void reset();	//order completed: ends every pizza made since the last reset
+	};
+	inline PizzaArena::PizzaArena(size_t blockBytes)
+	: first(nullptr), current(nullptr), used(0), blockSize(blockBytes), cleanups(nullptr) {}
+	inline PizzaArena::~PizzaArena() {
+		reset();
+		while (first != nullptr) {
+			Block *next = first->next;
+			free(first);
+			first = next;
+		}
+	}
+	inline void *PizzaArena::allocate(size_t size, size_t alignment) {
+		while (true) {
+			if (current != nullptr) {
+				uintptr_t start = reinterpret_cast<uintptr_t>(current->data()) + used;
+				size_t padding = (alignment - start % alignment) % alignment;
+				if (used + padding + size <= current->size) {
+					used += padding + size;
+					return reinterpret_cast<void *>(start + padding);
+				}
+				if (current->next != nullptr) {	//kept from a previous order
+					current = current->next;
+					used = 0;
+					continue;
+				}
+			}
+			size_t bytes = max(blockSize, size + alignment);
+			Block *block = static_cast<Block *>(malloc(sizeof(Block) + bytes));
+			if (block == nullptr)
+				throw bad_alloc();
+			*block = {nullptr, bytes};
+			if (current == nullptr)
+				first = block;
+			else
+				current->next = block;
+			current = block;
+			used = 0;
+		}
+	}
+	template<class T, class... Args>
+	T *PizzaArena::make(Args&&... args) {
+		static_assert(alignof(T) <= alignof(max_align_t), "over-aligned types are not supported");
+		void *memory = allocate(sizeof(T), alignof(T));
+		T *object = new (memory) T(std::forward<Args>(args)...);
+		if (!is_trivially_destructible<T>::value) {
+			Cleanup *cleanup = static_cast<Cleanup *>(allocate(sizeof(Cleanup), alignof(Cleanup)));
+			*cleanup = {destroy<T>, object, cleanups};
+			cleanups = cleanup;
+		}
+		return object;
+	}
+	inline void PizzaArena::reset() {
+		for (Cleanup *c=cleanups; c!=nullptr; c=c->next)
+			c->destroy(c->object);
+		cleanups = nullptr;
+		current = first;
+		used = 0;
+	}
+
 } //end namespace Attempt2
 
 
-int main() {
 
-	Attempt2::Pizza *pizza1 = new Attempt2::TomatoSauce(new Attempt2::Mozzarella (new Attempt2::PlainPizza()));
+//When the toppings are known at compile time the decorators can be templates: each one
+//wraps the type of the pizza below it, e.g. TomatoSauce<Mozzarella<PlainPizza>>, and the
+//cost and the description are constants computed by the compiler (no objects, no
+//virtual calls). The cost is added in the same order as the runtime chain, dough first,
+//so it is the same double. PizzaAdapter gives such a pizza the Attempt2::Pizza interface
+
+namespace Attempt3 {
+
+	//Fixed size string that can be built and concatenated at compile time
+	template<size_t N>
+	struct FixedString {
+		char text[N + 1] = {};
+		constexpr FixedString() {}
+		constexpr FixedString(const char (&s)[N + 1]) { for (size_t i=0; i<N; ++i) text[i] = s[i]; }
+		template<size_t M>
+		constexpr FixedString<N + M> operator+(const FixedString<M> &other) const {
+			FixedString<N + M> result;
+			for (size_t i=0; i<N; ++i) result.text[i] = text[i];
+			for (size_t i=0; i<M; ++i) result.text[N + i] = other.text[i];
+			return result;
+		}
+		constexpr size_t size() const { return N; }
+		constexpr string_view view() const { return string_view(text, N); }
+	};
+	template<size_t N> FixedString(const char (&)[N]) -> FixedString<N - 1>;
+
+	struct PlainPizza {
+		static constexpr double cost = 4.00;
+		static constexpr auto description = FixedString("Thin Dough");
+	};
+
+	template<class Inner>
+	struct Mozzarella {
+		static constexpr double cost = Inner::cost + 1.50;
+		static constexpr auto description = Inner::description + FixedString(", Mozzarella");
+	};
+
+	template<class Inner>
+	struct TomatoSauce {
+		static constexpr double cost = Inner::cost + 0.80;
+		static constexpr auto description = Inner::description + FixedString(", Tomato Sauce");
+	};
+
+	template<class P>
+	class PizzaAdapter : public Attempt2::Pizza {
+		public:
+			string getDescription() { return string(P::description.view()); }
+			double getCost() { return P::cost; }
+			string_view getPart() { return P::description.view(); }	//a single layer
+			double getPartCost() { return P::cost; }
+	};
+
+	static_assert(TomatoSauce<Mozzarella<PlainPizza>>::description.view() == "Thin Dough, Mozzarella, Tomato Sauce",
+				  "description is built at compile time");
+	static_assert(TomatoSauce<Mozzarella<PlainPizza>>::cost == (4.00 + 1.50) + 0.80, "cost is folded at compile time");
+
+} //end namespace Attempt3
+
+
+//BENCHMARK (run with --bench): descriptions of chains of 10, 100 and 1000 alternating
+//toppings, built the previous way (each layer returning the inner description plus its
+//own part), with getDescription, and appended into a receipt buffer that is reused
+namespace Bench {
+
+	class ConcatMozzarella : public Attempt2::Mozzarella {
+		public:
+			ConcatMozzarella (Attempt2::Pizza *p) : Mozzarella(p) {}
+			string getDescription() { return tempPizza->getDescription() + ", Mozzarella"; }
+	};
+	class ConcatTomatoSauce : public Attempt2::TomatoSauce {
+		public:
+			ConcatTomatoSauce (Attempt2::Pizza *p) : TomatoSauce(p) {}
+			string getDescription() { return tempPizza->getDescription() + ", Tomato Sauce"; }
+	};
+
+	//decorators do not own their inner pizza: every layer is kept in 'layers' to delete it
+	template<class M, class T>
+	Attempt2::Pizza *makeChain(int depth, vector<Attempt2::Pizza *> &layers) {
+		cout.setstate(ios::failbit);	//silences the "Adding..." messages
+		layers.push_back(new Attempt2::PlainPizza());
+		for (int i=0; i<depth; ++i)
+			layers.push_back((i & 1) ? (Attempt2::Pizza *) new T(layers.back()) : (Attempt2::Pizza *) new M(layers.back()));
+		cout.clear();
+		return layers.back();
+	}
+
+	void runDescriptionBenchmark() {
+		for (int depth : {10, 100, 1000}) {
+			vector<Attempt2::Pizza *> layers;
+			Attempt2::Pizza *appended = makeChain<Attempt2::Mozzarella, Attempt2::TomatoSauce>(depth, layers);
+			Attempt2::Pizza *concatenated = makeChain<ConcatMozzarella, ConcatTomatoSauce>(depth, layers);
+			const int calls = 2000000 / depth;
+			double ns[3];
+			size_t checksum[3] = {0, 0, 0};
+			string receipt;
+			for (int k=0; k<3; ++k) {
+				auto start = chrono::steady_clock::now();
+				for (int i=0; i<calls; ++i)
+					if (k == 0)
+						checksum[k] += concatenated->getDescription().size();
+					else if (k == 1)
+						checksum[k] += appended->getDescription().size();
+					else {
+						receipt.clear();
+						appended->appendDescription(receipt);
+						checksum[k] += receipt.size();
+					}
+				ns[k] = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / calls;
+			}
+			bool same = checksum[0] == checksum[1] && checksum[1] == checksum[2] && receipt == concatenated->getDescription();
+			cout << "Depth " << depth << ": concatenated " << ns[0] << " ns, getDescription " << ns[1]
+				 << " ns, appended to a reused buffer " << ns[2] << " ns" << (same ? "" : " (MISMATCH)") << endl;
+			for (auto layer : layers)
+				delete layer;
+		}
+	}
+
+	//receipts (cost and description) printed 1M/depth times from the live chain and from
+	//its frozen copy, which must give the same cost bit for bit and the same text
+	void runFreezeBenchmark() {
+		for (int depth : {10, 100, 1000}) {
+			vector<Attempt2::Pizza *> layers;
+			Attempt2::Pizza *live = makeChain<Attempt2::Mozzarella, Attempt2::TomatoSauce>(depth, layers);
+			Attempt2::FrozenPizza frozen = Attempt2::freeze(live);
+			const int receipts = 1000000 / depth;
+			double ns[2], total[2] = {0, 0};
+			string receipt;
+			for (int k=0; k<2; ++k) {
+				Attempt2::Pizza *pizza = k == 0 ? live : &frozen;
+				auto start = chrono::steady_clock::now();
+				for (int i=0; i<receipts; ++i) {
+					receipt.clear();
+					pizza->appendDescription(receipt);
+					total[k] += pizza->getCost() + receipt.size();
+				}
+				ns[k] = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / receipts;
+			}
+			double sum = 0;
+			for (auto &t : frozen.getToppings())
+				sum += t.cost;
+			bool same = total[0] == total[1] && frozen.getCost() == live->getCost() && sum == live->getCost()
+						&& frozen.getDescription() == live->getDescription() && frozen.getToppings().size() == size_t(depth + 1);
+			cout << "Depth " << depth << ": live chain " << ns[0] << " ns, frozen " << ns[1] << " ns per receipt"
+				 << (same ? "" : " (MISMATCH)") << endl;
+			for (auto layer : layers)
+				delete layer;
+		}
+	}
+
+	//the same pizza with 'depth' alternating toppings, as a compile-time type
+	template<int depth>
+	struct CompiledChain {
+		typedef typename CompiledChain<depth - 1>::type Inner;
+		typedef typename conditional<depth % 2 == 0, Attempt3::TomatoSauce<Inner>, Attempt3::Mozzarella<Inner>>::type type;
+	};
+	template<>
+	struct CompiledChain<0> { typedef Attempt3::PlainPizza type; };
+
+	//10M receipts (cost and description appended to a reused buffer) from the virtual
+	//Attempt2 chain, the Attempt3 type used directly and the Attempt3 type through the adapter
+	template<int depth>
+	void runCompiledChain() {
+		typedef typename CompiledChain<depth>::type Compiled;
+		vector<Attempt2::Pizza *> layers;
+		Attempt2::Pizza *live = makeChain<Attempt2::Mozzarella, Attempt2::TomatoSauce>(depth, layers);
+		Attempt3::PizzaAdapter<Compiled> adapter;
+		Attempt2::Pizza *adapted = &adapter;
+		const int receipts = 10000000;
+		double ns[3], total[3] = {0, 0, 0};
+		string receipt;
+		for (int k=0; k<3; ++k) {
+			auto start = chrono::steady_clock::now();
+			for (int i=0; i<receipts; ++i) {
+				receipt.clear();
+				if (k == 0) {
+					live->appendDescription(receipt);
+					total[k] += live->getCost();
+				} else if (k == 1) {
+					receipt.append(Compiled::description.view());
+					total[k] += Compiled::cost;
+				} else {
+					adapted->appendDescription(receipt);
+					total[k] += adapted->getCost();
+				}
+				total[k] += receipt.size();
+			}
+			ns[k] = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / receipts;
+		}
+		bool same = total[0] == total[1] && total[1] == total[2] && Compiled::cost == live->getCost()
+					&& Compiled::description.view() == live->getDescription();
+		cout << "Depth " << depth << ": virtual chain " << ns[0] << " ns, compile-time " << ns[1] << " ns, adapter "
+			 << ns[2] << " ns per receipt" << (same ? "" : " (MISMATCH)") << endl;
+		for (auto layer : layers)
+			delete layer;
+	}
+	void runCompileTimeBenchmark() {
+		runCompiledChain<2>();
+		runCompiledChain<8>();
+		runCompiledChain<32>();
+	}
+
+	//a burst of 1M orders of two pizzas (the ones in main), each layer allocated with new
+	//and deleted one by one, or made in one arena reset after each order
+	void runArenaBenchmark() {
+		const int orders = 1000000;
+		double ns[2], total[2] = {0, 0};
+		cout.setstate(ios::failbit);	//silences the "Adding..." messages
+		for (int k=0; k<2; ++k) {
+			Attempt2::PizzaArena arena;
+			auto start = chrono::steady_clock::now();
+			for (int i=0; i<orders; ++i) {
+				if (k == 0) {
+					Attempt2::Pizza *dough1 = new Attempt2::PlainPizza(), *dough2 = new Attempt2::PlainPizza();
+					Attempt2::Pizza *mozzarella = new Attempt2::Mozzarella(dough1);
+					Attempt2::Pizza *pizza1 = new Attempt2::TomatoSauce(mozzarella), *pizza2 = new Attempt2::TomatoSauce(dough2);
+					total[k] += pizza1->getCost() + pizza2->getCost();
+					delete pizza1;
+					delete mozzarella;
+					delete dough1;
+					delete pizza2;
+					delete dough2;
+				} else {
+					Attempt2::Pizza *pizza1 = arena.make<Attempt2::TomatoSauce>(arena.make<Attempt2::Mozzarella>(arena.make<Attempt2::PlainPizza>()));
+					Attempt2::Pizza *pizza2 = arena.make<Attempt2::TomatoSauce>(arena.make<Attempt2::PlainPizza>());
+					total[k] += pizza1->getCost() + pizza2->getCost();
+					arena.reset();
+				}
+			}
+			ns[k] = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / orders;
+		}
+		cout.clear();
+		cout << "Orders: new/delete " << ns[0] << " ns, arena " << ns[1] << " ns per order"
+			 << (total[0] == total[1] ? "" : " (MISMATCH)") << endl;
+	}
+} //end namespace Bench
+
+
+int main(int argc, char *argv[]) {
+
+	if (argc > 1 && string(argv[1]) == "--bench") {
+		Bench::runDescriptionBenchmark();
+		Bench::runFreezeBenchmark();
+		Bench::runCompileTimeBenchmark();
+		Bench::runArenaBenchmark();
+		return 0;
+	}
+
+	Attempt2::PizzaArena order;	//every layer of the order's pizzas lives here
+	Attempt2::Pizza *pizza1 = order.make<Attempt2::TomatoSauce>(order.make<Attempt2::Mozzarella>(order.make<Attempt2::PlainPizza>()));
 
 	cout << "Order pizza1:" << endl;
 	cout << "\tDescription = " << pizza1->getDescription() << endl;;
 	cout << "\tCoast = " << pizza1->getCost() << endl;;
 
-	Attempt2::Pizza *pizza2 = new Attempt2::TomatoSauce(new Attempt2::PlainPizza());
+	Attempt2::Pizza *pizza2 = order.make<Attempt2::TomatoSauce>(order.make<Attempt2::PlainPizza>());
 
 	cout << "Order pizza2:" << endl;
 	cout << "\tDescription = " << pizza2->getDescription() << endl;;
 	cout << "\tCoast = " << pizza2->getCost() << endl;;
 
-	delete pizza1;
-	delete pizza2;
+	Attempt2::Pizza *pizza3 = new Attempt3::PizzaAdapter<Attempt3::TomatoSauce<Attempt3::Mozzarella<Attempt3::PlainPizza>>>();
+
+	cout << "Order pizza3 (toppings chosen at compile time):" << endl;
+	cout << "\tDescription = " << pizza3->getDescription() << endl;;
+	cout << "\tCoast = " << pizza3->getCost() << endl;;
+
+	Attempt2::FrozenPizza frozen1 = Attempt2::freeze(pizza1);
+	cout << "Receipt of pizza1 (frozen):" << endl;
+	for (auto &topping : frozen1.getToppings())
+		cout << "\t" << topping.name << " " << topping.cost << endl;
+	cout << "\tTotal = " << frozen1.getCost() << endl;
+
+	order.reset();	//order completed: pizza1 and pizza2 with all their layers
+	delete pizza3;
 	cout << "END OF PROGRAM" << endl; // prints END OF PROGRAM
 	return 0;
 }
@@ -0,0 +1,217 @@
+//============================================================================
+// Name        : DP_LogSink.h
+// Author      : Mariane
+// Version     :
+// Copyright   : Your copyright notice
+// Description : Buffered logging sink shared by the design pattern demos
+//============================================================================
+//- Writing every device message with cout << endl flushes (a system call) on
+//  each event; here the calling thread only stores the event in its own buffer
+//- Formatting is deferred: an event is a printf format (a string literal) and
+//  up to 3 integer arguments, formatted later by a writer thread that writes
+//  the output in large blocks
+//- Every event takes a ticket from a global counter and the writer merges the
+//  thread buffers by ticket, so the output keeps the order in which events
+//  happened, also between threads
+//- With the level set to Off, logging is a no-op (one relaxed load)
+//- flush() waits until everything logged so far has been written
+//============================================================================
+
+#ifndef DP_LOGSINK_H_
+#define DP_LOGSINK_H_
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+
+namespace LogSink {
+
+enum class Level { Off, Info };
+
+struct Event {
+	uint64_t ticket;
+	const char *format;		//must outlive the event: use string literals
+	long args[3];
+};
+
+//Single-producer/single-consumer ring owned by one thread
+struct ThreadBuffer {
+	static const size_t CAPACITY = 4096;	//power of two
+	alignas(64) std::atomic<size_t> head;	//written by the owner thread
+	alignas(64) std::atomic<size_t> tail;	//written by the writer thread
+	std::atomic<bool> retired;				//owner thread has exited
+	Event events[CAPACITY];
+	ThreadBuffer() : head(0), tail(0), retired(false) {}
+};
+
+class Logger {
+	private:
+		std::atomic<Level> level;
+		std::atomic<FILE *> output;
+		alignas(64) std::atomic<uint64_t> tickets;
+		alignas(64) std::atomic<uint64_t> flushRequests;
+		std::atomic<uint64_t> flushed;
+		std::atomic<bool> running;
+		std::mutex buffersMutex;	//registration and removal only
+		std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+		std::atomic<uint64_t> registrations;
+		std::thread writer;
+
+		struct BufferOwner {	//marks the buffer retired when its thread exits
+			ThreadBuffer *buffer = nullptr;
+			~BufferOwner() { if (buffer != nullptr) buffer->retired.store(true, std::memory_order_release); }
+		};
+		ThreadBuffer &localBuffer();
+		void writeLoop();
+		void removeRetired(std::vector<ThreadBuffer *> &active);
+		Logger();
+	public:
+		static Logger &instance() { static Logger logger; return logger; }
+		~Logger();
+		Logger(const Logger &) = delete;
+		Logger &operator=(const Logger &) = delete;
+
+		void setLevel(Level l) { level.store(l, std::memory_order_relaxed); }
+		bool enabled(Level l) const { return l <= level.load(std::memory_order_relaxed); }
+		void setOutput(FILE *file) { flush(); output.store(file, std::memory_order_release); }	//stdout by default
+		void push(const char *format, long a0, long a1, long a2);
+		void flush();
+};
+
+inline Logger::Logger() : level(Level::Info), output(stdout), tickets(0), flushRequests(0), flushed(0),
+						  running(true), registrations(0) {
+	writer = std::thread(&Logger::writeLoop, this);
+}
+inline Logger::~Logger() {
+	flush();
+	running.store(false, std::memory_order_release);
+	writer.join();
+}
+inline ThreadBuffer &Logger::localBuffer() {
+	thread_local BufferOwner owner;
+	if (owner.buffer == nullptr) {
+		std::lock_guard<std::mutex> lock(buffersMutex);
+		buffers.emplace_back(new ThreadBuffer());
+		owner.buffer = buffers.back().get();
+		registrations.fetch_add(1, std::memory_order_release);
+	}
+	return *owner.buffer;
+}
+inline void Logger::push(const char *format, long a0, long a1, long a2) {
+	ThreadBuffer &buf = localBuffer();
+	size_t head = buf.head.load(std::memory_order_relaxed);
+	//wait for room before taking a ticket: the writer never waits for a ticket whose
+	//event cannot be stored
+	while (head - buf.tail.load(std::memory_order_acquire) == ThreadBuffer::CAPACITY)
+		std::this_thread::yield();
+	Event &e = buf.events[head & (ThreadBuffer::CAPACITY - 1)];
+	e.ticket = tickets.fetch_add(1, std::memory_order_acq_rel);
+	e.format = format;
+	e.args[0] = a0;
+	e.args[1] = a1;
+	e.args[2] = a2;
+	buf.head.store(head + 1, std::memory_order_release);
+}
+inline void Logger::flush() {
+	uint64_t request = flushRequests.fetch_add(1, std::memory_order_acq_rel) + 1;
+	while (flushed.load(std::memory_order_acquire) < request)
+		std::this_thread::yield();
+}
+inline void Logger::removeRetired(std::vector<ThreadBuffer *> &active) {
+	std::lock_guard<std::mutex> lock(buffersMutex);
+	for (size_t i=0; i<buffers.size(); )
+		if (buffers[i]->retired.load(std::memory_order_acquire)
+			&& buffers[i]->tail.load(std::memory_order_relaxed) == buffers[i]->head.load(std::memory_order_acquire)) {
+			buffers[i] = std::move(buffers.back());
+			buffers.pop_back();
+		} else
+			++i;
+	active.clear();
+	for (auto &b : buffers)
+		active.push_back(b.get());
+}
+inline void Logger::writeLoop() {
+	std::vector<ThreadBuffer *> active;
+	uint64_t known = 0;
+	uint64_t next = 0;		//next ticket to write
+	char block[65536];
+	size_t used = 0;
+	auto writeBlock = [&]() {
+		if (used > 0)
+			fwrite(block, 1, used, output.load(std::memory_order_acquire));
+		used = 0;
+	};
+
+	while (true) {
+		uint64_t request = flushRequests.load(std::memory_order_acquire);
+		uint64_t issued = tickets.load(std::memory_order_acquire);
+		if (registrations.load(std::memory_order_acquire) != known) {
+			known = registrations.load(std::memory_order_acquire);
+			removeRetired(active);
+		}
+
+		//merge by ticket; keep reading the same buffer while it holds the next ticket
+		size_t current = 0;
+		while (next < issued) {
+			bool found = false;
+			for (size_t k=0; k<active.size() && !found; ++k) {
+				ThreadBuffer &buf = *active[(current + k) % active.size()];
+				size_t tail = buf.tail.load(std::memory_order_relaxed);
+				if (tail == buf.head.load(std::memory_order_acquire))
+					continue;
+				const Event &e = buf.events[tail & (ThreadBuffer::CAPACITY - 1)];
+				if (e.ticket != next)
+					continue;
+				if (used > sizeof(block) - 512)
+					writeBlock();
+				int n = snprintf(block + used, 511, e.format, e.args[0], e.args[1], e.args[2]);
+				used += n < 0 ? 0 : (n > 510 ? 510 : n);
+				block[used++] = '\n';
+				buf.tail.store(tail + 1, std::memory_order_release);
+				current = (current + k) % active.size();
+				++next;
+				found = true;
+			}
+			if (!found) {	//ticket taken but not published yet, or by a thread not seen yet
+				if (registrations.load(std::memory_order_acquire) != known)
+					break;
+				std::this_thread::yield();
+			}
+		}
+		if (next < issued)
+			continue;
+
+		writeBlock();
+		fflush(output.load(std::memory_order_acquire));
+		removeRetired(active);	//buffers of threads that have exited
+		if (flushed.load(std::memory_order_relaxed) < request)
+			flushed.store(request, std::memory_order_release);
+		if (!running.load(std::memory_order_acquire) && tickets.load(std::memory_order_acquire) == next)
+			return;
+		if (tickets.load(std::memory_order_acquire) == next && flushRequests.load(std::memory_order_acquire) == request)
+			std::this_thread::sleep_for(std::chrono::microseconds(100));	//idle
+	}
+}
+
+//Logs one event: format is a printf format for long arguments ("%ld"), e.g.
+//LogSink::log("\tVolume = %ld", volume)
+template<class... Args>
+inline void log(const char *format, Args... args) {
+	static_assert(sizeof...(Args) <= 3, "LogSink::log takes up to 3 arguments");
+	Logger &logger = Logger::instance();
+	if (!logger.enabled(Level::Info))
+		return;
+	long values[3] = {static_cast<long>(args)...};
+	logger.push(format, values[0], values[1], values[2]);
+}
+inline void setLevel(Level l) { Logger::instance().setLevel(l); }
+inline void flush() { Logger::instance().flush(); }
+
+}	//namespace LogSink
+
+#endif /* DP_LOGSINK_H_ */
@@ -17,6 +17,27 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <functional>
+#include <chrono>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <sys/mman.h>	//POSIX: memory mapped tick files
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>	//pinning shard workers to cores
+#if defined(__SSE2__)
+#include <immintrin.h>	//vectorized change detection of price snapshots
+#endif
 
 using namespace std;
 
@@ -27,19 +48,51 @@ using namespace std;
 class Subject;
 //-------------------------------------------------------------
 
+//-------------------------------------------------------------
+//Registering returns a handle: the index of a slot in the subject plus the generation of
+//that slot. Unregistering bumps the generation, so an old handle is detected as stale
+//-------------------------------------------------------------
+struct ObserverHandle {
+	unsigned int index = 0;
+	unsigned int generation = 0;
+};
+
 //-------------------------------------------------------------
 //ATTENTION: interfaces and implementations are separated because using forward declaration,
 //the compiler complains that 'incomplete classes' are being used if implementation is
 //inside class interface
 //-------------------------------------------------------------
 
+//-------------------------------------------------------------
+//Set of prices as sent to observers and readers
+//-------------------------------------------------------------
+struct PriceUpdate {
+	double ibmPrice, aaplPrice, googPrice;
+};
+
 //-------------------------------------------------------------
 //OBSERVER AND STOCK OBSERVER INTERFACES
 //-------------------------------------------------------------
+//The observer remembers where it is registered: deleting it unregisters it, and a subject
+//being deleted detaches it, so none of them keeps a dangling pointer to the other
+//This is only safe when update is called on the thread deleting the observer: when
+//~Observer runs, the derived parts are already destroyed. An observer of a subject calling
+//update from another thread (AsyncObserverRelay) must be unsubscribed, or the subject
+//deleted, before it is deleted; ~Observer aborts if it is still attached to such a subject
 class Observer{
+	private:
+		Subject *subject = nullptr;
+		ObserverHandle handle;
 	public:
-		virtual ~Observer() {}
+		Observer() {}
+		Observer(const Observer &) = delete;	//a copy would share the handle of the original
+		Observer &operator=(const Observer &) = delete;
+		virtual ~Observer();
 		virtual void update(double ibmPrice, double aaplPrice, double googPrice) = 0;
+		void attached(Subject *s, ObserverHandle h);	//called by the subject only (or a subject
+		void detached();								//wrapping it, see ShardedStockGrabber)
+		void unsubscribe();
+		ObserverHandle getHandle() const { return handle; }
 };
 class StockObserver : public Observer{
 	private:
@@ -53,29 +106,97 @@ class StockObserver : public Observer{
 		void printPrices();
 };
 
+//-------------------------------------------------------------
+//PRICE SEQLOCK INTERFACE
+//Consumers that pull prices from other threads, instead of being notified, read them
+//through a sequence lock: the writer makes the sequence odd, stores the prices and makes
+//it even again; a reader retries if the sequence was odd or changed during its copy. The
+//writer never waits and readers never lock, and a reader never sees a torn set of prices
+//-------------------------------------------------------------
+class PriceSeqLock {
+	private:
+		alignas(64) atomic<unsigned int> sequence;
+		atomic<double> ibmPrice, aaplPrice, googPrice;
+	public:
+		PriceSeqLock();
+		void store(const PriceUpdate &u);	//single writer
+		PriceUpdate load() const;			//any number of readers
+};
+
 //-------------------------------------------------------------
 //SUBJECT AND STOCK GRABBER INTERFACES
 //-------------------------------------------------------------
 class Subject {
 	public:
 		virtual ~Subject() {}
-		virtual void procRegister (Observer *o) = 0;
-		virtual void procUnregister (Observer *o) = 0;
+		virtual ObserverHandle procRegister (Observer *o) = 0;
+		virtual bool procUnregister (ObserverHandle h) = 0;	//false if handle is stale
 		virtual void notifyObserver() = 0;
+		virtual bool notifiesFromOtherThreads() const { return false; }
 };
+//Setters notify on their own, unless they are called inside a batch (beginUpdate/commitUpdate
+//or setPrices): then observers are notified only once, when the batch is committed
+//Observers are kept in a slot map: 'observers' stays dense for notifyObserver, each
+//handle points to a slot that knows the dense position, and unregistering moves the last
+//observer into the hole, so both register and unregister are O(1)
+//An observer may unregister itself or others (or be deleted) inside update: while notifying,
+//unregistering only leaves a hole that the loop skips, and holes are filled when the
+//outermost notification ends, so no observer misses the tick or gets it twice
+//Every notification also publishes the prices for getSnapshot, callable from any thread
+//Setting a price to the value it already has does not notify anyone
 class StockGrabber : public Subject {
 	private:
-		vector<Observer *> observers;
-		double ibmPrice, aaplPrice, googPrice;
+		struct Slot {
+			unsigned int denseIndex;
+			unsigned int generation;
+		};
+		vector<Observer *> observers;		//dense, notification order
+		vector<unsigned int> denseToSlot;	//slot of each dense position
+		vector<Slot> slots;
+		vector<unsigned int> freeSlots;
+		int notifyDepth = 0;		//notifyObserver calls running (update may notify again)
+		vector<unsigned int> holes;	//dense positions unregistered while notifying
+		void fillHoles();
+		double ibmPrice = 0, aaplPrice = 0, googPrice = 0;
+		PriceSeqLock published;
+		int batchDepth = 0;			//nested beginUpdate calls still open
+		bool batchDirty = false;	//some price changed inside the current batch
+		void priceChanged();
 	public:
-		void procRegister(Observer *o);
-		void procUnregister(Observer *o);
+		~StockGrabber();
+		ObserverHandle procRegister(Observer *o);
+		bool procUnregister(ObserverHandle h);
 		void notifyObserver();
 		void setIBMPrice (double p);
 		void setAAPLPrice (double p);
 		void setGOOGPrice (double p);
+		void beginUpdate();
+		void commitUpdate();
+		void setPrices(double ibm, double aapl, double goog);
+		void forwardPrices(const PriceUpdate &u);	//stores and notifies even if nothing changed
+		PriceUpdate getSnapshot() const { return published.load(); }
 };
 
+//--------------------------------------------------------------
+//OBSERVER IMPLEMENTATION
+//--------------------------------------------------------------
+void Observer::attached(Subject *s, ObserverHandle h) {
+	subject = s;
+	handle = h;
+}
+Observer::~Observer() {
+	if (subject != nullptr && subject->notifiesFromOtherThreads()) {
+		cerr << "Observer deleted while subscribed to a relay: unsubscribe it first" << endl;
+		abort();
+	}
+	unsubscribe();
+}
+void Observer::detached() { subject = nullptr; }
+void Observer::unsubscribe() {
+	if (subject != nullptr)
+		subject->procUnregister(handle);	//calls detached()
+}
+
 //--------------------------------------------------------------
 //STOCK OBSERVER IMPLEMENTATION
 //--------------------------------------------------------------
@@ -98,28 +219,1089 @@ void StockObserver::printPrices() {
 	cout << "\tObs ID " << observerID << ": IBM<" << ibmPrice << ">; APPLE<" << aaplPrice << ">; GOOGLE<" << googPrice << ">;" << endl;
 }
 
+//--------------------------------------------------------------
+//PRICE SEQLOCK IMPLEMENTATION
+//--------------------------------------------------------------
+PriceSeqLock::PriceSeqLock() : sequence(0), ibmPrice(0), aaplPrice(0), googPrice(0) {}
+void PriceSeqLock::store(const PriceUpdate &u) {
+	unsigned int seq = sequence.load(memory_order_relaxed);
+	sequence.store(seq + 1, memory_order_relaxed);	//odd: write in progress
+	atomic_thread_fence(memory_order_release);		//prices can't be stored before the odd sequence
+	ibmPrice.store(u.ibmPrice, memory_order_relaxed);
+	aaplPrice.store(u.aaplPrice, memory_order_relaxed);
+	googPrice.store(u.googPrice, memory_order_relaxed);
+	sequence.store(seq + 2, memory_order_release);
+}
+PriceUpdate PriceSeqLock::load() const {
+	PriceUpdate u;
+	unsigned int before, after;
+	do {
+		before = sequence.load(memory_order_acquire);
+		u.ibmPrice = ibmPrice.load(memory_order_relaxed);
+		u.aaplPrice = aaplPrice.load(memory_order_relaxed);
+		u.googPrice = googPrice.load(memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);		//prices can't be loaded after the check
+		after = sequence.load(memory_order_relaxed);
+	} while ((before & 1) || before != after);
+	return u;
+}
+
 //--------------------------------------------------------------
 //STOCK GRABBER IMPLEMENTATION
 //--------------------------------------------------------------
-void StockGrabber::procRegister(Observer *o) { observers.push_back(o); }
-void StockGrabber::procUnregister(Observer *o) {
-	auto iterO = find(observers.begin(),observers.end(), o);
-	if (iterO != observers.end())
-		observers.erase(iterO);
+StockGrabber::~StockGrabber() {
+	for (auto obs : observers)
+		if (obs != nullptr)
+			obs->detached();
+}
+ObserverHandle StockGrabber::procRegister(Observer *o) {
+	o->unsubscribe();	//an observer is registered in one subject at a time
+	ObserverHandle h;
+	if (freeSlots.empty()) {
+		h.index = slots.size();
+		slots.push_back({0, 0});
+	}
+	else {
+		h.index = freeSlots.back();
+		freeSlots.pop_back();
+	}
+	h.generation = slots[h.index].generation;
+	slots[h.index].denseIndex = observers.size();
+	observers.push_back(o);
+	denseToSlot.push_back(h.index);
+	o->attached(this, h);
+	return h;
+}
+bool StockGrabber::procUnregister(ObserverHandle h) {
+	if (h.index >= slots.size() || slots[h.index].generation != h.generation)
+		return false;	//stale: already unregistered (and maybe reused)
+	unsigned int dense = slots[h.index].denseIndex;
+	Observer *o = observers[dense];
+	if (notifyDepth > 0) {	//moving the last observer now would make the loop skip it
+		observers[dense] = nullptr;
+		holes.push_back(dense);
+	} else {
+		observers[dense] = observers.back();
+		denseToSlot[dense] = denseToSlot.back();
+		slots[denseToSlot[dense]].denseIndex = dense;
+		observers.pop_back();
+		denseToSlot.pop_back();
+	}
+	++slots[h.index].generation;
+	freeSlots.push_back(h.index);
+	o->detached();
+	return true;
 }
 void StockGrabber::notifyObserver() {
-	for (auto obs : observers)
-		obs->update(ibmPrice, aaplPrice, googPrice);
+	published.store({ibmPrice, aaplPrice, googPrice});
+	++notifyDepth;
+	for (size_t i=0; i<observers.size(); ++i)
+		if (observers[i] != nullptr)
+			observers[i]->update(ibmPrice, aaplPrice, googPrice);
+	if (--notifyDepth == 0 && !holes.empty())
+		fillHoles();
+}
+void StockGrabber::fillHoles() {
+	//highest first: every position above the current hole is already filled, so the last
+	//observer is either the hole itself or a live one that can move into it
+	sort(holes.begin(), holes.end(), greater<unsigned int>());
+	for (auto dense : holes) {
+		if (dense + 1 < observers.size()) {
+			observers[dense] = observers.back();
+			denseToSlot[dense] = denseToSlot.back();
+			slots[denseToSlot[dense]].denseIndex = dense;
+		}
+		observers.pop_back();
+		denseToSlot.pop_back();
+	}
+	holes.clear();
+}
+void StockGrabber::priceChanged() {
+	if (batchDepth > 0)
+		batchDirty = true;	//deferred to commitUpdate
+	else
+		notifyObserver();
+}
+void StockGrabber::setIBMPrice (double p)  { if (p != ibmPrice)  { ibmPrice = p; priceChanged(); } }
+void StockGrabber::setAAPLPrice (double p) { if (p != aaplPrice) { aaplPrice = p; priceChanged(); } }
+void StockGrabber::setGOOGPrice (double p) { if (p != googPrice) { googPrice = p; priceChanged(); } }
+void StockGrabber::beginUpdate() { ++batchDepth; }
+void StockGrabber::commitUpdate() {
+	if (batchDepth == 0 || --batchDepth > 0)
+		return;		//unbalanced commit or still inside an outer batch
+	if (batchDirty) {
+		batchDirty = false;
+		notifyObserver();
+	}
+}
+void StockGrabber::setPrices(double ibm, double aapl, double goog) {
+	beginUpdate();
+	setIBMPrice(ibm);
+	setAAPLPrice(aapl);
+	setGOOGPrice(goog);
+	commitUpdate();
+}
+void StockGrabber::forwardPrices(const PriceUpdate &u) {
+	ibmPrice = u.ibmPrice;
+	aaplPrice = u.aaplPrice;
+	googPrice = u.googPrice;
+	notifyObserver();
+}
+
+//-------------------------------------------------------------
+//TOPIC OBSERVER AND TOPIC STOCK GRABBER INTERFACES
+//The classic Observer above is told the three prices on every change. When following
+//thousands of symbols, the subject keeps a table of prices indexed by symbol ID and
+//each observer subscribes to the symbols it cares about: a price change is sent only to
+//the subscribers of that symbol (cost grows with interested observers, not all of them)
+//Each subscription may also have a change threshold: an observer is told about a new
+//price only when it moved far enough from the last price sent to it. A whole snapshot of
+//prices is compared to the table with SIMD to find the few symbols that really changed
+//-------------------------------------------------------------
+typedef unsigned int SymbolID;
+
+//Move needed since the last delivered price, both as absolute value and as percentage
+//of that price; a price is delivered when it passes both (zero: any change is delivered)
+struct ChangeThreshold {
+	double absolute = 0;
+	double percent = 0;
+};
+
+class TopicObserver {
+	public:
+		virtual ~TopicObserver() {}
+		virtual void update(SymbolID symbol, double price) = 0;
+};
+class TopicSubject {
+	public:
+		virtual ~TopicSubject() {}
+		virtual void procSubscribe (TopicObserver *o, SymbolID symbol, ChangeThreshold threshold = ChangeThreshold()) = 0;
+		virtual void procUnsubscribe (TopicObserver *o, SymbolID symbol) = 0;
+		virtual void notifyObserver(SymbolID symbol) = 0;
+};
+//Deleting the observer unsubscribes all its symbols, so the subject must outlive it
+class TopicStockObserver : public TopicObserver {
+	private:
+		vector<SymbolID> symbols;	//subscribed symbols...
+		vector<double> prices;		//...and their last known prices (same position)
+		static int observerIDTracker;
+		int observerID;
+		TopicSubject *stockGrabber;
+	public:
+		TopicStockObserver(TopicSubject *stckGrab, const vector<SymbolID> &symbolSet,
+						   ChangeThreshold threshold = ChangeThreshold());
+		~TopicStockObserver();
+		void update(SymbolID symbol, double price);
+		void printPrices();
+};
+class TopicStockGrabber : public TopicSubject {
+	private:
+		struct Subscription {
+			TopicObserver *observer;
+			ChangeThreshold threshold;
+			double lastSent;		//last price delivered to this observer
+		};
+		vector<double> prices;						//prices[symbol]
+		vector<vector<Subscription>> subscribers;	//subscribers[symbol]
+		vector<SymbolID> changed;					//scratch for setSnapshot
+		void deliver(SymbolID symbol);				//honoring thresholds
+	public:
+		TopicStockGrabber(size_t nSymbols);
+		size_t getSymbolCount() const { return prices.size(); }
+		double getPrice(SymbolID symbol) const { return prices[symbol]; }
+		void procSubscribe(TopicObserver *o, SymbolID symbol, ChangeThreshold threshold = ChangeThreshold());
+		void procUnsubscribe(TopicObserver *o, SymbolID symbol);
+		void notifyObserver(SymbolID symbol);		//every subscriber, ignoring thresholds
+		void setPrice(SymbolID symbol, double p);
+		void setPrices(const vector<pair<SymbolID, double>> &ticks);
+		size_t setSnapshot(const vector<double> &newPrices);	//all symbols; returns how many changed
+};
+
+//--------------------------------------------------------------
+//TOPIC STOCK OBSERVER IMPLEMENTATION
+//--------------------------------------------------------------
+int TopicStockObserver::observerIDTracker = 0;
+
+TopicStockObserver::TopicStockObserver(TopicSubject *stckGrab, const vector<SymbolID> &symbolSet,
+									   ChangeThreshold threshold) {
+	symbols = symbolSet;
+	prices.assign(symbols.size(), 0);
+	stockGrabber = stckGrab;
+	observerID = ++observerIDTracker;
+	cout << "\tNew Topic Observer " << observerID << " subscribed to " << symbols.size() << " symbols" << endl;
+	for (auto sym : symbols)
+		stockGrabber->procSubscribe(this, sym, threshold);
+}
+TopicStockObserver::~TopicStockObserver() {
+	for (auto sym : symbols)
+		stockGrabber->procUnsubscribe(this, sym);	//no-op if already unsubscribed
+}
+void TopicStockObserver::update(SymbolID symbol, double price) {
+	//only subscribed symbols arrive here, and the subscription set is small
+	for (size_t i=0; i<symbols.size(); ++i)
+		if (symbols[i] == symbol)
+			prices[i] = price;
+	printPrices();
+}
+void TopicStockObserver::printPrices() {
+	cout << "\tTopic Obs ID " << observerID << ":";
+	for (size_t i=0; i<symbols.size(); ++i)
+		cout << " SYM" << symbols[i] << "<" << prices[i] << ">;";
+	cout << endl;
 }
-void StockGrabber::setIBMPrice (double p)  { ibmPrice = p; notifyObserver(); }
-void StockGrabber::setAAPLPrice (double p) { aaplPrice = p; notifyObserver(); }
-void StockGrabber::setGOOGPrice (double p) { googPrice = p; notifyObserver(); }
 
 //--------------------------------------------------------------
+//TOPIC STOCK GRABBER IMPLEMENTATION
+//--------------------------------------------------------------
+TopicStockGrabber::TopicStockGrabber(size_t nSymbols) : prices(nSymbols, 0), subscribers(nSymbols) {}
+void TopicStockGrabber::procSubscribe(TopicObserver *o, SymbolID symbol, ChangeThreshold threshold) {
+	subscribers[symbol].push_back({o, threshold, prices[symbol]});
+}
+void TopicStockGrabber::procUnsubscribe(TopicObserver *o, SymbolID symbol) {
+	//order of subscribers does not matter: swap with the last one and pop
+	vector<Subscription> &subs = subscribers[symbol];
+	for (size_t i=0; i<subs.size(); ++i)
+		if (subs[i].observer == o) {
+			subs[i] = subs.back();
+			subs.pop_back();
+			return;
+		}
+}
+void TopicStockGrabber::notifyObserver(SymbolID symbol) {
+	for (auto &sub : subscribers[symbol]) {
+		sub.lastSent = prices[symbol];
+		sub.observer->update(symbol, prices[symbol]);
+	}
+}
+void TopicStockGrabber::deliver(SymbolID symbol) {
+	double p = prices[symbol];
+	for (auto &sub : subscribers[symbol]) {
+		double move = fabs(p - sub.lastSent);
+		if (move == 0 || move < sub.threshold.absolute || move * 100 < sub.threshold.percent * fabs(sub.lastSent))
+			continue;	//not far enough from what this observer already knows
+		sub.lastSent = p;
+		sub.observer->update(symbol, p);
+	}
+}
+void TopicStockGrabber::setPrice(SymbolID symbol, double p) {
+	if (p != prices[symbol]) {
+		prices[symbol] = p;
+		deliver(symbol);
+	}
+}
+void TopicStockGrabber::setPrices(const vector<pair<SymbolID, double>> &ticks) {
+	for (auto &tick : ticks)
+		prices[tick.first] = tick.second;
+	for (auto &tick : ticks)
+		deliver(tick.first);
+}
+
+//Appends the indices where the two arrays differ. Most symbols don't change on a quiet
+//market, so compare 4 (AVX) or 2 (SSE2) prices at once and only look closer at a mismatch
+void findChangedPrices(const double *oldP, const double *newP, size_t n, vector<SymbolID> &changed) {
+	size_t i = 0;
+#if defined(__AVX__)
+	for (; i + 4 <= n; i += 4) {
+		__m256d diff = _mm256_cmp_pd(_mm256_loadu_pd(oldP + i), _mm256_loadu_pd(newP + i), _CMP_NEQ_UQ);
+		for (int mask = _mm256_movemask_pd(diff); mask != 0; mask &= mask - 1)
+			changed.push_back(i + __builtin_ctz(mask));
+	}
+#elif defined(__SSE2__)
+	for (; i + 2 <= n; i += 2) {
+		__m128d diff = _mm_cmpneq_pd(_mm_loadu_pd(oldP + i), _mm_loadu_pd(newP + i));
+		for (int mask = _mm_movemask_pd(diff); mask != 0; mask &= mask - 1)
+			changed.push_back(i + __builtin_ctz(mask));
+	}
+#endif
+	for (; i<n; ++i)
+		if (oldP[i] != newP[i])
+			changed.push_back(i);
+}
+
+size_t TopicStockGrabber::setSnapshot(const vector<double> &newPrices) {
+	size_t n = min(newPrices.size(), prices.size());
+	changed.clear();
+	findChangedPrices(prices.data(), newPrices.data(), n, changed);
+	for (auto sym : changed)
+		prices[sym] = newPrices[sym];
+	for (auto sym : changed)
+		deliver(sym);
+	return changed.size();
+}
+
+//-------------------------------------------------------------
+//ASYNC OBSERVER RELAY INTERFACE
+//A slow observer (printPrices writes to cout with endl) stalls the publisher, because
+//notifyObserver calls every update on the publisher thread. The relay is registered in
+//the publisher as an Observer and acts as the Subject of one observer: update only
+//pushes the prices into a bounded lock-free SPSC ring, and a worker thread drains it
+//calling the real observer. When the ring is full, the overflow policy decides between
+//waiting for the consumer (Block), dropping the oldest queued update (DropOldest) or
+//dropping everything queued so only the latest prices are delivered (Conflate)
+//The observer is called from the worker thread, so it must be complete while registered:
+//register it once constructed (StockObserver registers in its constructor, so it must be
+//the most derived class) and unsubscribe it, or delete the relay, before deleting it
+//-------------------------------------------------------------
+enum class OverflowPolicy { Block, DropOldest, Conflate };
 
-int main() {
+//Single producer (publisher) / single consumer (relay worker). The producer only moves
+//tail, except when discarding: then it moves head by CAS, as the consumer does, so a
+//consumer that read a slot being discarded fails its CAS and throws the read away
+class PriceRing {
+	private:
+		struct Slot { atomic<double> ibmPrice, aaplPrice, googPrice; };
+		unique_ptr<Slot[]> slots;
+		size_t mask;
+		alignas(64) atomic<size_t> head;	//next slot to read
+		alignas(64) atomic<size_t> tail;	//next slot to write
+	public:
+		PriceRing(size_t capacity);
+		bool tryPush(const PriceUpdate &u);
+		bool tryPop(PriceUpdate &u);
+		size_t discard(size_t keep);
+		size_t getCapacity() const { return mask + 1; }
+};
+
+class AsyncObserverRelay : public Observer, public Subject {
+	private:
+		mutex targetLock;	//held by the worker while delivering: procUnregister waits for it
+		Observer *target;
+		unsigned int targetGeneration;
+		OverflowPolicy policy;
+		PriceRing ring;
+		atomic<bool> running;
+		atomic<long> dropped;
+		thread worker;
+	public:
+		AsyncObserverRelay(Subject *pub, OverflowPolicy pol, size_t capacity = 64);
+		~AsyncObserverRelay();
+		void update(double ibmPrice, double aaplPrice, double googPrice);	//publisher side
+		ObserverHandle procRegister(Observer *o);
+		bool procUnregister(ObserverHandle h);
+		void notifyObserver();		//worker side: delivers everything queued
+		bool notifiesFromOtherThreads() const { return true; }
+		long getDropped() const { return dropped.load(); }
+};
+
+//--------------------------------------------------------------
+//PRICE RING IMPLEMENTATION
+//--------------------------------------------------------------
+PriceRing::PriceRing(size_t capacity) : head(0), tail(0) {
+	size_t cap = 1;
+	while (cap < capacity)
+		cap <<= 1;	//power of two: index with a mask
+	slots.reset(new Slot[cap]);
+	mask = cap - 1;
+}
+bool PriceRing::tryPush(const PriceUpdate &u) {
+	size_t t = tail.load(memory_order_relaxed);
+	if (t - head.load(memory_order_acquire) > mask)
+		return false;	//full
+	Slot &slot = slots[t & mask];
+	slot.ibmPrice.store(u.ibmPrice, memory_order_relaxed);
+	slot.aaplPrice.store(u.aaplPrice, memory_order_relaxed);
+	slot.googPrice.store(u.googPrice, memory_order_relaxed);
+	tail.store(t + 1, memory_order_release);
+	return true;
+}
+bool PriceRing::tryPop(PriceUpdate &u) {
+	size_t h = head.load(memory_order_acquire);
+	do {
+		if (h == tail.load(memory_order_acquire))
+			return false;	//empty
+		Slot &slot = slots[h & mask];
+		u.ibmPrice = slot.ibmPrice.load(memory_order_relaxed);
+		u.aaplPrice = slot.aaplPrice.load(memory_order_relaxed);
+		u.googPrice = slot.googPrice.load(memory_order_relaxed);
+	} while (!head.compare_exchange_weak(h, h + 1, memory_order_acq_rel));
+	return true;
+}
+size_t PriceRing::discard(size_t keep) {
+	size_t h = head.load(memory_order_acquire);
+	size_t t = tail.load(memory_order_relaxed);
+	while (t - h > keep)
+		if (head.compare_exchange_weak(h, t - keep, memory_order_acq_rel))
+			return t - keep - h;
+	return 0;	//consumer already made room
+}
+
+//--------------------------------------------------------------
+//ASYNC OBSERVER RELAY IMPLEMENTATION
+//--------------------------------------------------------------
+AsyncObserverRelay::AsyncObserverRelay(Subject *pub, OverflowPolicy pol, size_t capacity)
+	: target(nullptr), targetGeneration(0), policy(pol), ring(capacity), running(true), dropped(0) {
+	worker = thread([this]() {
+		while (running.load(memory_order_acquire)) {
+			notifyObserver();
+			this_thread::sleep_for(chrono::microseconds(50));	//idle: ring was drained
+		}
+		notifyObserver();	//deliver what was queued before stopping
+	});
+	pub->procRegister(this);
+}
+AsyncObserverRelay::~AsyncObserverRelay() {
+	unsubscribe();	//no more updates from the publisher
+	running.store(false, memory_order_release);
+	worker.join();
+	if (target != nullptr)
+		target->detached();
+}
+void AsyncObserverRelay::update(double ibmPrice, double aaplPrice, double googPrice) {
+	PriceUpdate u = {ibmPrice, aaplPrice, googPrice};
+	while (!ring.tryPush(u)) {
+		switch (policy) {
+			case OverflowPolicy::Block:		 this_thread::yield(); break;
+			case OverflowPolicy::DropOldest: dropped += ring.discard(ring.getCapacity() - 1); break;
+			case OverflowPolicy::Conflate:	 dropped += ring.discard(0); break;
+		}
+	}
+}
+ObserverHandle AsyncObserverRelay::procRegister(Observer *o) {
+	//a relay serves a single observer: the previous one, if any, is replaced
+	o->unsubscribe();
+	Observer *previous;
+	ObserverHandle h;
+	{
+		lock_guard<mutex> lock(targetLock);
+		previous = target;
+		target = o;
+		h.generation = ++targetGeneration;
+	}
+	if (previous != nullptr)
+		previous->detached();
+	o->attached(this, h);
+	return h;
+}
+bool AsyncObserverRelay::procUnregister(ObserverHandle h) {
+	Observer *previous;
+	{
+		lock_guard<mutex> lock(targetLock);
+		if (target == nullptr || h.generation != targetGeneration)
+			return false;
+		previous = target;
+		target = nullptr;
+		++targetGeneration;
+	}
+	previous->detached();
+	return true;
+}
+void AsyncObserverRelay::notifyObserver() {
+	PriceUpdate u;
+	while (ring.tryPop(u)) {
+		lock_guard<mutex> lock(targetLock);
+		if (target != nullptr)
+			target->update(u.ibmPrice, u.aaplPrice, u.googPrice);
+	}
+}
+
+//-------------------------------------------------------------
+//SHARDED STOCK GRABBER INTERFACE
+//One thread walking the whole observer vector caps notifications at one core. Here the
+//observers are split across N shards, each one a StockGrabber of its own walked by a
+//worker thread pinned to a core. A tick is broadcast by storing the prices and bumping
+//an epoch: every worker notifies its own observers and acknowledges the epoch, and
+//notifyObserver returns when all shards are done (same semantics as StockGrabber)
+//An idle worker spins for a while, so back to back ticks are picked up at once, and then
+//parks on a condition variable; the publisher only signals it when some worker is parked
+//Registering, unregistering and deleting observers must be done by the publisher thread,
+//between ticks (as with StockGrabber, which is not thread safe either)
+//-------------------------------------------------------------
+class ShardedStockGrabber : public Subject {
+	private:
+		struct Shard {
+			StockGrabber grabber;
+			thread worker;
+			alignas(64) atomic<uint64_t> doneEpoch;
+			Shard() : doneEpoch(0) {}
+		};
+		vector<unique_ptr<Shard>> shards;
+		alignas(64) atomic<uint64_t> epoch;
+		atomic<bool> running;
+		static constexpr chrono::microseconds SPIN_TIME{200};	//then an idle worker parks
+		alignas(64) atomic<unsigned int> parkedWorkers;
+		mutex parkLock;
+		condition_variable parked;
+		PriceUpdate prices;		//written by the publisher only while all shards are idle
+		unsigned int nextShard;
+		void work(Shard &shard, unsigned int core);
+	public:
+		ShardedStockGrabber(unsigned int nShards);
+		~ShardedStockGrabber();
+		unsigned int getShardCount() const { return shards.size(); }
+		ObserverHandle procRegister(Observer *o);	//round robin across shards
+		bool procUnregister(ObserverHandle h);
+		void notifyObserver();
+		void setIBMPrice (double p)  { if (p != prices.ibmPrice)  { prices.ibmPrice = p; notifyObserver(); } }
+		void setAAPLPrice (double p) { if (p != prices.aaplPrice) { prices.aaplPrice = p; notifyObserver(); } }
+		void setGOOGPrice (double p) { if (p != prices.googPrice) { prices.googPrice = p; notifyObserver(); } }
+		void setPrices(double ibm, double aapl, double goog);
+};
+
+//--------------------------------------------------------------
+//SHARDED STOCK GRABBER IMPLEMENTATION
+//--------------------------------------------------------------
+ShardedStockGrabber::ShardedStockGrabber(unsigned int nShards) : epoch(0), running(true), parkedWorkers(0),
+																  prices({0, 0, 0}), nextShard(0) {
+	unsigned int nCores = max(1u, thread::hardware_concurrency());
+	for (unsigned int i=0; i<max(1u, nShards); ++i)
+		shards.emplace_back(new Shard());
+	for (unsigned int i=0; i<shards.size(); ++i)
+		shards[i]->worker = thread(&ShardedStockGrabber::work, this, ref(*shards[i]), i % nCores);
+}
+ShardedStockGrabber::~ShardedStockGrabber() {
+	{
+		lock_guard<mutex> lock(parkLock);
+		running.store(false);
+	}
+	parked.notify_all();
+	for (auto &shard : shards)
+		shard->worker.join();
+}
+void ShardedStockGrabber::work(Shard &shard, unsigned int core) {
+#ifdef __linux__
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(core, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+	uint64_t seen = 0;
+	auto idleSince = chrono::steady_clock::now();
+	while (true) {
+		uint64_t e = epoch.load(memory_order_acquire);
+		if (e == seen) {
+			if (!running.load(memory_order_acquire))
+				return;
+			if (chrono::steady_clock::now() - idleSince < SPIN_TIME) {
+				this_thread::yield();
+				continue;
+			}
+			//announce the worker before checking the epoch again: either it sees the new
+			//epoch or the publisher sees it parked and signals it (both are seq_cst)
+			unique_lock<mutex> lock(parkLock);
+			parkedWorkers.fetch_add(1);
+			parked.wait(lock, [&]() { return epoch.load() != seen || !running.load(); });
+			parkedWorkers.fetch_sub(1);
+			continue;
+		}
+		seen = e;
+		shard.grabber.forwardPrices(prices);
+		shard.doneEpoch.store(e, memory_order_release);
+		idleSince = chrono::steady_clock::now();
+	}
+}
+ObserverHandle ShardedStockGrabber::procRegister(Observer *o) {
+	o->unsubscribe();
+	unsigned int s = nextShard;
+	nextShard = (nextShard + 1) % shards.size();
+	ObserverHandle h = shards[s]->grabber.procRegister(o);
+	h.index = h.index * shards.size() + s;	//the shard is part of the handle
+	o->attached(this, h);	//unregistering goes through this subject
+	return h;
+}
+bool ShardedStockGrabber::procUnregister(ObserverHandle h) {
+	ObserverHandle local = h;
+	local.index = h.index / shards.size();
+	return shards[h.index % shards.size()]->grabber.procUnregister(local);
+}
+void ShardedStockGrabber::notifyObserver() {
+	uint64_t e = epoch.fetch_add(1) + 1;	//publishes 'prices'
+	if (parkedWorkers.load() > 0) {
+		lock_guard<mutex> lock(parkLock);	//a worker checking the epoch has not waited yet
+		parked.notify_all();
+	}
+	for (auto &shard : shards)
+		while (shard->doneEpoch.load(memory_order_acquire) < e)
+			this_thread::yield();
+}
+void ShardedStockGrabber::setPrices(double ibm, double aapl, double goog) {
+	if (ibm == prices.ibmPrice && aapl == prices.aaplPrice && goog == prices.googPrice)
+		return;
+	prices = {ibm, aapl, goog};
+	notifyObserver();
+}
+
+//-------------------------------------------------------------
+//TICK RECORDER AND TICK REPLAYER INTERFACES
+//To load the observers with realistic traffic, the recorder observes a StockGrabber and
+//writes every price that changed to a binary tick file; the replayer maps that file in
+//memory and sends the ticks to a StockGrabber, as fast as possible or respecting the
+//recorded timestamps, measuring ticks/s and how long each notification took
+//File: TickFileHeader followed by tickCount fixed size Tick records (native endianness)
+//-------------------------------------------------------------
+enum StockSymbol : uint32_t { IBM = 0, AAPL = 1, GOOG = 2 };
+
+struct TickFileHeader {
+	char magic[4];			//"TICK"
+	uint32_t version;
+	uint64_t tickCount;
+};
+struct Tick {
+	uint64_t timestampNs;	//since the recording started
+	uint32_t symbol;		//StockSymbol
+	uint32_t reserved;
+	double price;
+};
+
+class TickRecorder : public Observer {
+	private:
+		FILE *file;
+		uint64_t tickCount;
+		PriceUpdate last;
+		chrono::steady_clock::time_point start;
+		void writeTick(uint64_t timestampNs, StockSymbol symbol, double price);
+	public:
+		TickRecorder(Subject *stckGrab, const string &path);
+		~TickRecorder();
+		void update(double ibmPrice, double aaplPrice, double googPrice);
+		void close();		//stops recording and completes the file header
+		uint64_t getTickCount() const { return tickCount; }
+};
+
+struct ReplayStats {
+	uint64_t ticks;
+	double ticksPerSec;
+	double p50Us, p99Us, p999Us, maxUs;	//time spent in the setter, notification included
+};
+
+class TickReplayer {
+	private:
+		const Tick *ticks;
+		uint64_t tickCount;
+		void *mapping;
+		size_t mappingSize;
+	public:
+		TickReplayer(const string &path);
+		~TickReplayer();
+		bool isOpen() const { return mapping != nullptr; }
+		uint64_t getTickCount() const { return tickCount; }
+		ReplayStats replay(StockGrabber &sGrabb, bool recordedPacing);
+};
+
+//--------------------------------------------------------------
+//TICK RECORDER IMPLEMENTATION
+//--------------------------------------------------------------
+TickRecorder::TickRecorder(Subject *stckGrab, const string &path) : tickCount(0), last({0, 0, 0}) {
+	file = fopen(path.c_str(), "wb");
+	if (file == nullptr) {
+		cerr << "TickRecorder: cannot create " << path << endl;
+		return;
+	}
+	TickFileHeader header = {{'T', 'I', 'C', 'K'}, 1, 0};
+	fwrite(&header, sizeof(header), 1, file);	//tickCount is filled in by close
+	start = chrono::steady_clock::now();
+	stckGrab->procRegister(this);
+}
+TickRecorder::~TickRecorder() { close(); }
+void TickRecorder::writeTick(uint64_t timestampNs, StockSymbol symbol, double price) {
+	Tick tick = {timestampNs, symbol, 0, price};
+	fwrite(&tick, sizeof(tick), 1, file);
+	++tickCount;
+}
+void TickRecorder::update(double ibmPrice, double aaplPrice, double googPrice) {
+	uint64_t now = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+	if (ibmPrice != last.ibmPrice)	 writeTick(now, IBM, ibmPrice);
+	if (aaplPrice != last.aaplPrice) writeTick(now, AAPL, aaplPrice);
+	if (googPrice != last.googPrice) writeTick(now, GOOG, googPrice);
+	last = {ibmPrice, aaplPrice, googPrice};
+}
+void TickRecorder::close() {
+	unsubscribe();
+	if (file == nullptr)
+		return;
+	TickFileHeader header = {{'T', 'I', 'C', 'K'}, 1, tickCount};
+	fseek(file, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, file);
+	fclose(file);
+	file = nullptr;
+}
+
+//--------------------------------------------------------------
+//TICK REPLAYER IMPLEMENTATION
+//--------------------------------------------------------------
+TickReplayer::TickReplayer(const string &path) : ticks(nullptr), tickCount(0), mapping(nullptr), mappingSize(0) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		cerr << "TickReplayer: cannot open " << path << endl;
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(TickFileHeader)) {
+		void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr != MAP_FAILED) {
+			mapping = addr;
+			mappingSize = st.st_size;
+		}
+	}
+	::close(fd);	//the mapping stays valid
+	if (mapping == nullptr) {
+		cerr << "TickReplayer: cannot map " << path << endl;
+		return;
+	}
+
+	const TickFileHeader *header = static_cast<const TickFileHeader *>(mapping);
+	uint64_t ticksInFile = (mappingSize - sizeof(TickFileHeader)) / sizeof(Tick);
+	if (memcmp(header->magic, "TICK", 4) != 0 || header->version != 1 || header->tickCount > ticksInFile) {
+		cerr << "TickReplayer: " << path << " is not a valid tick file" << endl;
+		munmap(mapping, mappingSize);
+		mapping = nullptr;
+		return;
+	}
+	madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+	ticks = reinterpret_cast<const Tick *>(header + 1);
+	tickCount = header->tickCount;
+}
+TickReplayer::~TickReplayer() {
+	if (mapping != nullptr)
+		munmap(mapping, mappingSize);
+}
+ReplayStats TickReplayer::replay(StockGrabber &sGrabb, bool recordedPacing) {
+	vector<float> latencyUs(tickCount);
+	auto start = chrono::steady_clock::now();
+
+	for (uint64_t i=0; i<tickCount; ++i) {
+		const Tick &tick = ticks[i];
+		if (recordedPacing)
+			while (chrono::steady_clock::now() - start < chrono::nanoseconds(tick.timestampNs - ticks[0].timestampNs))
+				this_thread::yield();
+
+		auto tickStart = chrono::steady_clock::now();
+		switch (tick.symbol) {
+			case IBM:  sGrabb.setIBMPrice(tick.price); break;
+			case AAPL: sGrabb.setAAPLPrice(tick.price); break;
+			case GOOG: sGrabb.setGOOGPrice(tick.price); break;
+		}
+		latencyUs[i] = chrono::duration<float, micro>(chrono::steady_clock::now() - tickStart).count();
+	}
+	double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	ReplayStats stats = {tickCount, 0, 0, 0, 0, 0};
+	if (tickCount == 0)
+		return stats;
+	auto percentile = [&](double p) {
+		auto nth = latencyUs.begin() + size_t(p * (tickCount - 1));
+		nth_element(latencyUs.begin(), nth, latencyUs.end());
+		return double(*nth);
+	};
+	stats.ticksPerSec = tickCount / secs;
+	stats.p50Us = percentile(0.50);
+	stats.p99Us = percentile(0.99);
+	stats.p999Us = percentile(0.999);
+	stats.maxUs = *max_element(latencyUs.begin(), latencyUs.end());
+	return stats;
+}
+
+//--------------------------------------------------------------
+//BENCHMARKS (run with --bench)
+//--------------------------------------------------------------
+//Compares one tick changing the three symbols through the single setters against the
+//same tick sent as a batch, with 10k observers. Output of printPrices is discarded, but
+//the formatting work is still done, once per update call.
+class NullBuffer : public streambuf {
+	protected:
+		int overflow(int c) { return c; }
+};
+class CountingStockObserver : public StockObserver {
+	public:
+		static long updateCalls;
+		CountingStockObserver(Subject *stckGrab) : StockObserver(stckGrab) {}
+		void update(double ibmPrice, double aaplPrice, double googPrice) {
+			++updateCalls;
+			StockObserver::update(ibmPrice, aaplPrice, googPrice);
+		}
+};
+long CountingStockObserver::updateCalls = 0;
+
+void runBatchBenchmark() {
+	const int nObservers = 10000, nTicks = 100;
+	NullBuffer nullBuf;
+	streambuf *coutBuf = cout.rdbuf(&nullBuf);
+
+	StockGrabber sGrabb;
+	vector<CountingStockObserver *> obs;
+	for (int i=0; i<nObservers; ++i)
+		obs.push_back(new CountingStockObserver(&sGrabb));
+
+	for (int mode=0; mode<2; ++mode) {
+		CountingStockObserver::updateCalls = 0;
+		auto start = chrono::steady_clock::now();
+		for (int t=0; t<nTicks; ++t) {
+			if (mode == 0) {
+				sGrabb.setIBMPrice(100.0 + t);
+				sGrabb.setAAPLPrice(200.0 + t);
+				sGrabb.setGOOGPrice(300.0 + t);
+			}
+			else
+				sGrabb.setPrices(100.0 + t, 200.0 + t, 300.0 + t);
+		}
+		double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+		cout.rdbuf(coutBuf);
+		cout << (mode == 0 ? "Single setters: " : "Batch setPrices:") << " "
+			 << CountingStockObserver::updateCalls / nTicks << " update/printPrices calls per tick; "
+			 << ms / nTicks << " ms per tick" << endl;
+		cout.rdbuf(&nullBuf);
+	}
+
+	for (auto o : obs)
+		delete o;
+	cout.rdbuf(coutBuf);
+}
+
+//--------------------------------------------------------------
+
+//Publisher latency with one slow observer (200us per update), called directly or
+//through an async relay with each overflow policy
+class SlowObserver : public Observer {
+	public:
+		long updates = 0;
+		void update(double, double, double) {
+			++updates;
+			this_thread::sleep_for(chrono::microseconds(200));
+		}
+};
+
+void runAsyncBenchmark() {
+	const int nTicks = 2000;
+	const char *names[] = {"Synchronous", "Async Block", "Async DropOldest", "Async Conflate"};
+
+	for (int mode=0; mode<4; ++mode) {
+		StockGrabber sGrabb;
+		SlowObserver slowObs;
+		unique_ptr<AsyncObserverRelay> relay;
+		if (mode == 0)
+			sGrabb.procRegister(&slowObs);
+		else {
+			relay.reset(new AsyncObserverRelay(&sGrabb, OverflowPolicy(mode - 1)));
+			relay->procRegister(&slowObs);
+		}
+
+		double worstUs = 0;
+		auto start = chrono::steady_clock::now();
+		for (int t=0; t<nTicks; ++t) {
+			auto tickStart = chrono::steady_clock::now();
+			sGrabb.setPrices(100.0 + t, 200.0 + t, 300.0 + t);
+			worstUs = max(worstUs, chrono::duration<double, micro>(chrono::steady_clock::now() - tickStart).count());
+		}
+		double totalUs = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+		long dropped = relay ? relay->getDropped() : 0;
+		relay.reset();	//drains and joins the worker
+
+		cout << names[mode] << ": publisher " << totalUs / nTicks << " us/tick (worst " << worstUs
+			 << " us); delivered " << slowObs.updates << ", dropped " << dropped << endl;
+	}
+}
+
+//Subscription churn with 100k registered observers: unregister a random observer and
+//register it again, with the old vector find/erase and with handles
+class SilentObserver : public Observer {
+	public:
+		void update(double, double, double) {}
+};
+
+void runChurnBenchmark() {
+	const int nObservers = 100000, nChurn = 20000;
+	vector<SilentObserver> obs(nObservers);
+	srand(42);
+
+	vector<Observer *> linear;
+	for (auto &o : obs)
+		linear.push_back(&o);
+	auto start = chrono::steady_clock::now();
+	for (int i=0; i<nChurn; ++i) {
+		Observer *o = &obs[rand() % nObservers];
+		linear.erase(find(linear.begin(), linear.end(), o));
+		linear.push_back(o);
+	}
+	double linearMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+	StockGrabber sGrabb;
+	for (auto &o : obs)
+		sGrabb.procRegister(&o);
+	start = chrono::steady_clock::now();
+	for (int i=0; i<nChurn; ++i) {
+		Observer &o = obs[rand() % nObservers];
+		sGrabb.procUnregister(o.getHandle());
+		sGrabb.procRegister(&o);
+	}
+	double slotMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+	cout << "Churn at " << nObservers << " observers: find/erase " << linearMs * 1000 / nChurn
+		 << " us/op; slot map handles " << slotMs * 1000 / nChurn << " us/op" << endl;
+}
+
+//One writer publishing prices as fast as it can while 1 to 8 readers take snapshots.
+//The writer always sets (x, x+1, x+2), so a torn snapshot would be detected
+void runSnapshotBenchmark() {
+	const chrono::milliseconds duration(200);
+
+	for (int nReaders=1; nReaders<=8; nReaders*=2) {
+		StockGrabber sGrabb;
+		atomic<bool> stop(false);
+		atomic<long> reads(0), torn(0);
+		long writes = 0;
+
+		vector<thread> readers;
+		for (int r=0; r<nReaders; ++r)
+			readers.emplace_back([&]() {
+				long myReads = 0, myTorn = 0;
+				while (!stop.load(memory_order_relaxed)) {
+					PriceUpdate u = sGrabb.getSnapshot();
+					if (u.aaplPrice != u.ibmPrice + 1 && u.ibmPrice != 0)
+						++myTorn;
+					if (u.googPrice != u.ibmPrice + 2 && u.ibmPrice != 0)
+						++myTorn;
+					++myReads;
+				}
+				reads += myReads;
+				torn += myTorn;
+			});
+
+		auto end = chrono::steady_clock::now() + duration;
+		while (chrono::steady_clock::now() < end)
+			for (int i=0; i<1000; ++i, ++writes)
+				sGrabb.setPrices(writes + 1, writes + 2, writes + 3);
+		stop = true;
+		for (auto &t : readers)
+			t.join();
+
+		double secs = chrono::duration<double>(duration).count();
+		cout << "Snapshot, " << nReaders << " reader(s): " << writes / secs / 1e6 << " M writes/s; "
+			 << reads / secs / 1e6 << " M reads/s; torn reads " << torn << endl;
+	}
+}
+
+//Records one million ticks (random walk, one symbol per tick) and replays them at full
+//speed against a growing number of observers
+void runReplayBenchmark() {
+	const char *path = "dp_observer_bench_ticks.bin";
+	const int nTicks = 1000000;
+	{
+		StockGrabber sGrabb;
+		TickRecorder recorder(&sGrabb, path);
+		double prices[3] = {100, 200, 300};
+		srand(7);
+		for (int i=0; i<nTicks; ++i) {
+			int sym = i % 3;
+			prices[sym] += (rand() % 201 - 100) / 100.0;
+			switch (sym) {
+				case IBM:  sGrabb.setIBMPrice(prices[sym]); break;
+				case AAPL: sGrabb.setAAPLPrice(prices[sym]); break;
+				case GOOG: sGrabb.setGOOGPrice(prices[sym]); break;
+			}
+		}
+	}
+
+	TickReplayer replayer(path);
+	for (int nObservers : {0, 100, 1000}) {
+		StockGrabber sGrabb;
+		vector<SilentObserver> obs(nObservers);
+		for (auto &o : obs)
+			sGrabb.procRegister(&o);
+		ReplayStats st = replayer.replay(sGrabb, false);
+		cout << "Replay " << st.ticks << " ticks, " << nObservers << " observers: " << st.ticksPerSec / 1e6
+			 << " M ticks/s; latency us p50 " << st.p50Us << ", p99 " << st.p99Us << ", p99.9 "
+			 << st.p999Us << ", max " << st.maxUs << endl;
+	}
+	remove(path);
+}
+
+//Ticks/s with 100k observers split across 1 to N shards (N = cores available)
+void runShardedBenchmark() {
+	const int nObservers = 100000, nTicks = 500;
+	vector<SilentObserver> obs(nObservers);
+	unsigned int nCores = max(1u, thread::hardware_concurrency());
+
+	for (unsigned int nShards=1; nShards<=nCores; nShards*=2) {
+		ShardedStockGrabber sGrabb(nShards);
+		for (auto &o : obs)
+			sGrabb.procRegister(&o);
+		auto start = chrono::steady_clock::now();
+		for (int t=0; t<nTicks; ++t)
+			sGrabb.setPrices(100.0 + t, 200.0 + t, 300.0 + t);
+		double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << "Sharded, " << nShards << " shard(s) of " << nCores << " cores: " << nTicks / secs
+			 << " ticks/s; " << double(nObservers) * nTicks / secs / 1e6 << " M updates/s" << endl;
+		for (auto &o : obs)
+			o.unsubscribe();
+	}
+}
+
+//Snapshots of 10k symbols where 10% of the prices move a little (up to 0.1%) each time,
+//one observer per symbol: notifications sent with no threshold and with a 0.5% threshold,
+//and time to find the changed symbols with a plain loop and with findChangedPrices
+class CountingTopicObserver : public TopicObserver {
+	public:
+		static long updates;
+		void update(SymbolID, double) { ++updates; }
+};
+long CountingTopicObserver::updates = 0;
+
+void runThresholdBenchmark() {
+	const int nSymbols = 10000, nSnapshots = 200;
+	srand(11);
+	vector<vector<double>> snapshots(nSnapshots, vector<double>(nSymbols));
+	vector<double> walk(nSymbols, 100.0);
+	for (auto &snap : snapshots) {
+		for (int s=0; s<nSymbols; ++s)
+			if (rand() % 10 == 0)
+				walk[s] *= 1 + (rand() % 201 - 100) / 100000.0;
+		snap = walk;
+	}
+
+	for (double percent : {0.0, 0.5}) {
+		TopicStockGrabber tGrabb(nSymbols);
+		vector<CountingTopicObserver> obs(nSymbols);
+		tGrabb.setSnapshot(vector<double>(nSymbols, 100.0));
+		ChangeThreshold threshold;
+		threshold.percent = percent;
+		for (int s=0; s<nSymbols; ++s)
+			tGrabb.procSubscribe(&obs[s], s, threshold);
+
+		CountingTopicObserver::updates = 0;
+		long changedSymbols = 0;
+		for (auto &snap : snapshots)
+			changedSymbols += tGrabb.setSnapshot(snap);
+		cout << "Threshold " << percent << "%: " << changedSymbols / nSnapshots << " changed symbols and "
+			 << CountingTopicObserver::updates / nSnapshots << " notifications per snapshot" << endl;
+	}
+
+	vector<SymbolID> changed;
+	long found = 0;
+	auto start = chrono::steady_clock::now();
+	for (int i=1; i<nSnapshots; ++i) {
+		changed.clear();
+		for (int s=0; s<nSymbols; ++s)
+			if (snapshots[i-1][s] != snapshots[i][s])
+				changed.push_back(s);
+		found += changed.size();
+	}
+	double scalarUs = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+	start = chrono::steady_clock::now();
+	for (int i=1; i<nSnapshots; ++i) {
+		changed.clear();
+		findChangedPrices(snapshots[i-1].data(), snapshots[i].data(), nSymbols, changed);
+		found -= changed.size();
+	}
+	double simdUs = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+	cout << "Change detection of " << nSymbols << " symbols: loop " << scalarUs / (nSnapshots - 1)
+		 << " us; findChangedPrices " << simdUs / (nSnapshots - 1) << " us" << (found == 0 ? "" : " (MISMATCH)") << endl;
+}
+
+int main(int argc, char *argv[]) {
+
+	if (argc > 1 && string(argv[1]) == "--bench") {
+		runBatchBenchmark();
+		runAsyncBenchmark();
+		runChurnBenchmark();
+		runSnapshotBenchmark();
+		runReplayBenchmark();
+		runShardedBenchmark();
+		runThresholdBenchmark();
+		return 0;
+	}
 
 	StockGrabber *sGrabb = new StockGrabber();
+	TickRecorder *recorder = new TickRecorder(sGrabb, "dp_observer_ticks.bin");
 
 	cout << "Adding observer 1..." << endl;
 	StockObserver *sObs1 = new StockObserver(sGrabb);
@@ -134,6 +1316,9 @@ int main() {
 	sGrabb->setAAPLPrice(291.7);
 	sGrabb->setGOOGPrice(254.3);
 
+	cout << "Changing all stock prices in one batch..." << endl;
+	sGrabb->setPrices(201.3, 288.1, 259.9);
+
 	cout << "Adding observer 3..." << endl;
 	StockObserver *sObs3 = new StockObserver(sGrabb);
 	sObs3->printPrices();
@@ -142,15 +1327,86 @@ int main() {
 	sGrabb->setIBMPrice(97.5);
 
 	cout << "Removing observer 2..." << endl;
-	sGrabb->procUnregister(sObs2);
+	ObserverHandle hObs2 = sObs2->getHandle();
+	sGrabb->procUnregister(hObs2);
+	cout << "Removing observer 2 again with its old handle: "
+		 << (sGrabb->procUnregister(hObs2) ? "removed" : "stale handle rejected") << endl;
+
+	cout << "Deleting observer 3 while still registered..." << endl;
+	delete sObs3;
 
 	cout << "Changing IBM stock prices..." << endl;
 	sGrabb->setIBMPrice(312.9);
 
-	delete sGrabb;
+	PriceUpdate snap = sGrabb->getSnapshot();
+	cout << "Snapshot read by a consumer: IBM<" << snap.ibmPrice << ">; APPLE<" << snap.aaplPrice
+		 << ">; GOOGLE<" << snap.googPrice << ">;" << endl;
+
+	cout << "Adding observer 4 behind an async relay (conflating)..." << endl;
+	AsyncObserverRelay *relay = new AsyncObserverRelay(sGrabb, OverflowPolicy::Conflate);
+	StockObserver *sObs4 = new StockObserver(relay);
+	sGrabb->setPrices(315.0, 290.2, 260.4);
+	delete relay;	//waits for the queued update to be delivered, then detaches observer 4
+	delete sObs4;
+
+	delete sGrabb;	//observer 1 is detached, deleting it later is safe
 	delete sObs1;
 	delete sObs2;
-	delete sObs3;
+
+	cout << "Replaying the " << recorder->getTickCount() << " recorded ticks at recorded pacing..." << endl;
+	recorder->close();
+	StockGrabber *replayGrabb = new StockGrabber();
+	StockObserver *replayObs = new StockObserver(replayGrabb);
+	TickReplayer *replayer = new TickReplayer("dp_observer_ticks.bin");
+	ReplayStats stats = replayer->replay(*replayGrabb, true);
+	cout << "\tReplayed " << stats.ticks << " ticks; p50 latency " << stats.p50Us << " us" << endl;
+	delete replayer;
+	delete replayObs;
+	delete replayGrabb;
+	delete recorder;
+	remove("dp_observer_ticks.bin");
+
+	cout << "Creating sharded stock grabber with 2 shards..." << endl;
+	ShardedStockGrabber *shGrabb = new ShardedStockGrabber(2);
+	StockObserver *shObs1 = new StockObserver(shGrabb);
+	StockObserver *shObs2 = new StockObserver(shGrabb);
+	cout << "Changing all stock prices (each shard notifies its observer)..." << endl;
+	shGrabb->setPrices(120.0, 230.0, 340.0);
+	delete shObs1;
+	delete shObs2;
+	delete shGrabb;
+
+	cout << "Creating topic stock grabber with 1000 symbols..." << endl;
+	TopicStockGrabber *tGrabb = new TopicStockGrabber(1000);
+	TopicStockObserver *tObs1 = new TopicStockObserver(tGrabb, {0, 1});
+	TopicStockObserver *tObs2 = new TopicStockObserver(tGrabb, {1, 999});
+
+	cout << "Changing symbol 1 (both observers subscribed)..." << endl;
+	tGrabb->setPrice(1, 42.5);
+	cout << "Changing symbol 999 (observer 2 subscribed)..." << endl;
+	tGrabb->setPrice(999, 13.1);
+	cout << "Changing symbol 500 (no subscribers)..." << endl;
+	tGrabb->setPrice(500, 77.0);
+
+	cout << "Unsubscribing observer 1 from symbol 1..." << endl;
+	tGrabb->procUnsubscribe(tObs1, 1);
+	tGrabb->setPrices({{0, 10.0}, {1, 43.0}});
+
+	cout << "Adding topic observer 3 on symbol 1, only for moves of 5% or more..." << endl;
+	ChangeThreshold fivePercent;
+	fivePercent.percent = 5;
+	TopicStockObserver *tObs3 = new TopicStockObserver(tGrabb, {1}, fivePercent);
+	cout << "Changing symbol 1 by 1% (observer 3 not told)..." << endl;
+	tGrabb->setPrice(1, 43.43);
+	cout << "Changing symbol 1 by 6% (observer 3 told)..." << endl;
+	tGrabb->setPrice(1, 45.58);
+	cout << "Same price again (nobody told)..." << endl;
+	tGrabb->setPrice(1, 45.58);
+
+	delete tObs1;	//unsubscribes from tGrabb: delete the observers first
+	delete tObs2;
+	delete tObs3;
+	delete tGrabb;
 
 	cout << "END OF PROGRAM" << endl; // prints END OF PROGRAM
 	return 0;
@@ -17,82 +17,540 @@
 #include <iostream>
 #include <algorithm>
 #include <vector>
-#include <list>
+#include <array>
+#include <cstdint>
+#include <random>
+#include <cstring>
+#include <memory>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <functional>
+#include <map>
+#include <iomanip>
 
 using namespace std;
 
+namespace Registry {
+
+	//Instead of each singleton hand-rolling its lazy creation, they are declared in a
+	//registry, with the names of the singletons they depend on (which must be declared
+	//first, so there are no cycles). A singleton is created on first use, after its
+	//dependencies (created in parallel when there are many), or all of them at once in
+	//warmUp. shutdown destroys them in reverse creation order, so no singleton outlives
+	//the ones it depends on. The construction time of each one is recorded
+	//shutdown is the end of the program for the singletons: no thread may still be using
+	//one, and asking for one afterwards aborts (they are not created again)
+	class SingletonRegistry {
+		private:
+			struct Entry {
+				string name;
+				vector<Entry *> dependencies;
+				function<void *()> create;
+				function<void (void *)> destroy;
+				atomic<void *> instance;
+				once_flag created;
+				double constructionMs;
+				Entry() : instance(nullptr), constructionMs(0) {}
+			};
+			map<string, unique_ptr<Entry>> entries;	//filled while declaring, read-only afterwards
+			mutex orderLock;
+			vector<Entry *> creationOrder;
+			atomic<bool> shutDown;
+			SingletonRegistry() : shutDown(false) {}
+			void *declareEntry(const string &name, const vector<string> &dependencies,
+							   function<void *()> create, function<void (void *)> destroy);
+			void *initialize(void *entry);	//creates the dependencies, then the singleton (once)
+		public:
+			template <typename T> class Service;
+			static SingletonRegistry &getInstance();
+			template <typename T>
+			Service<T> declare(const string &name, const vector<string> &dependencies, function<T *()> factory);
+			void warmUp();
+			void shutdown();
+			void printStartupProfile();
+	};
+
+	//What a singleton keeps to reach its instance: once created, get is one atomic load
+	template <typename T>
+	class SingletonRegistry::Service {
+		private:
+			void *entry;
+		public:
+			Service(void *e) : entry(e) {}
+			T *get() const {
+				void *instance = static_cast<Entry *>(entry)->instance.load(memory_order_acquire);
+				if (instance == nullptr)
+					instance = SingletonRegistry::getInstance().initialize(entry);
+				return static_cast<T *>(instance);
+			}
+	};
+	//-------------------------------------------------------------------------
+	SingletonRegistry &SingletonRegistry::getInstance() {
+		static SingletonRegistry registry;	//magic static: the registry itself can't be registered
+		return registry;
+	}
+	//-------------------------------------------------------------------------
+	template <typename T>
+	SingletonRegistry::Service<T> SingletonRegistry::declare(const string &name, const vector<string> &dependencies, function<T *()> factory) {
+		return Service<T>(declareEntry(name, dependencies, [factory]() -> void * { return factory(); },
+									   [](void *instance) { delete static_cast<T *>(instance); }));
+	}
+	void *SingletonRegistry::declareEntry(const string &name, const vector<string> &dependencies,
+										  function<void *()> create, function<void (void *)> destroy) {
+		unique_ptr<Entry> e(new Entry());
+		e->name = name;
+		for (auto &dep : dependencies) {
+			auto iterD = entries.find(dep);
+			if (iterD == entries.end()) {
+				cerr << "Singleton " << name << " depends on " << dep << ", not declared before it" << endl;
+				abort();
+			}
+			e->dependencies.push_back(iterD->second.get());
+		}
+		e->create = create;
+		e->destroy = destroy;
+		void *entry = e.get();
+		entries[name] = move(e);
+		return entry;
+	}
+	//-------------------------------------------------------------------------
+	void *SingletonRegistry::initialize(void *entry) {
+		Entry &e = *static_cast<Entry *>(entry);
+		if (shutDown.load(memory_order_acquire)) {	//get found no instance: it was destroyed
+			cerr << "Singleton " << e.name << " used after the registry was shut down" << endl;
+			abort();
+		}
+		//independent dependencies are created in parallel, the last one by this thread
+		vector<thread> helpers;
+		for (size_t i=0; i+1<e.dependencies.size(); ++i)
+			if (e.dependencies[i]->instance.load(memory_order_acquire) == nullptr)
+				helpers.emplace_back(&SingletonRegistry::initialize, this, e.dependencies[i]);
+		if (!e.dependencies.empty())
+			initialize(e.dependencies.back());
+		for (auto &t : helpers)
+			t.join();
+
+		call_once(e.created, [&]() {
+			auto start = chrono::steady_clock::now();
+			void *instance = e.create();
+			e.constructionMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+			{
+				lock_guard<mutex> lock(orderLock);
+				creationOrder.push_back(&e);
+			}
+			e.instance.store(instance, memory_order_release);
+		});
+		return e.instance.load(memory_order_acquire);
+	}
+	//-------------------------------------------------------------------------
+	void SingletonRegistry::warmUp() {
+		//one thread per singleton: call_once makes the dependents wait for their dependencies
+		vector<thread> threads;
+		for (auto &entry : entries)
+			threads.emplace_back(&SingletonRegistry::initialize, this, entry.second.get());
+		for (auto &t : threads)
+			t.join();
+	}
+	//-------------------------------------------------------------------------
+	void SingletonRegistry::shutdown() {
+		lock_guard<mutex> lock(orderLock);
+		shutDown.store(true, memory_order_release);
+		for (auto iterE = creationOrder.rbegin(); iterE != creationOrder.rend(); ++iterE) {
+			(*iterE)->destroy((*iterE)->instance.exchange(nullptr));
+			cout << "\tdestroyed " << (*iterE)->name << endl;
+		}
+		creationOrder.clear();
+	}
+	//-------------------------------------------------------------------------
+	void SingletonRegistry::printStartupProfile() {
+		lock_guard<mutex> lock(orderLock);
+		for (auto e : creationOrder) {
+			cout << "\t" << left << setw(16) << e->name << right << setw(10) << fixed << setprecision(3)
+				 << e->constructionMs << " ms" << defaultfloat << setprecision(6) << "   depends on:";
+			for (auto dep : e->dependencies)
+				cout << " " << dep->name;
+			cout << endl;
+		}
+	}
+
+} //end namespace
+
+
 namespace PureSingleton {
 
 	//This a singleton class, pure, with no purpose
 	class Singleton {
 		private:
-			static Singleton *uniqueInstance;
+			static Registry::SingletonRegistry::Service<Singleton> service;
 			Singleton() {}	//if public, you do not prevent multiple objects!
 		public:
 			static Singleton *getInstance() {
-				if (uniqueInstance == nullptr)
-					//Lazy instantiation: if instance is not needed, it will never be created
-					uniqueInstance = new Singleton();
-				return uniqueInstance;
+				//Lazy instantiation: if instance is not needed, it will never be created
+				return service.get();
 			}
 	};
+	Registry::SingletonRegistry::Service<Singleton> Singleton::service =
+			Registry::SingletonRegistry::getInstance().declare<Singleton>("pure", {}, []() { return new Singleton(); });
 }
 
 
 namespace Scrabble {
 
+	const size_t BAG_SIZE = 110;	//tiles in a new bag
+	const size_t RACK_SIZE = 7;		//tiles a player holds
+	const size_t BAG_CAPACITY = 128;	//power of two >= BAG_SIZE: the bag is a ring
+
+	const array<char, BAG_SIZE> ALL_LETTERS = \
+			{{'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a', \
+			 'e', 'e', 'e', 'e', 'e', 'e', 'e', 'e', 'e', 'e', 'e', \
+			 'i', 'i', 'i', 'i', 'i', 'i', 'i', 'i', 'i', 'i', 'i', \
+			 'o', 'o', 'o', 'o', 'o', 'o', 'o', 'o', 'o', 'o', 'o', \
+			 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', \
+			 'b', 'b', 'b', 'c', 'c', 'c', 'd', 'd', 'd', 'f', 'f', \
+			 'f', 'g', 'g', 'g', 'h', 'h', 'h', 'j', 'j', 'j', 'l', \
+			 'l', 'l', 'm', 'm', 'm', 'n', 'n', 'n', 'p', 'p', 'p', \
+			 'q', 'q', 'q', 'r', 'r', 'r', 's', 's', 's', 't', 't', \
+			 't', 'v', 'v', 'v', 'x', 'x', 'x', 'z', 'z', 'z', 'z'}};
+
+	//Random numbers for shuffling: xoshiro256** (by Blackman and Vigna) is small and
+	//fast, and the same seed gives the same sequence on every machine, so a game (or a
+	//million simulated ones) can be replayed. The seed is spread over the state with
+	//splitmix64, as its authors recommend
+	class Xoshiro256 {
+		private:
+			uint64_t state[4];
+			static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+		public:
+			static uint64_t splitmix64(uint64_t &x) {
+				uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+				z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+				z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+				return z ^ (z >> 31);
+			}
+			explicit Xoshiro256(uint64_t seed) {
+				for (auto &word : state)
+					word = splitmix64(seed);
+			}
+			uint64_t next() {
+				uint64_t result = rotl(state[1] * 5, 7) * 9;
+				uint64_t t = state[1] << 17;
+				state[2] ^= state[0];
+				state[3] ^= state[1];
+				state[1] ^= state[2];
+				state[0] ^= state[3];
+				state[2] ^= t;
+				state[3] = rotl(state[3], 45);
+				return result;
+			}
+			//uniform in [0, range), Lemire's multiply and shift, rejecting the few biased values
+			uint32_t bounded(uint32_t range) {
+				uint64_t m = (next() >> 32) * range;
+				if (uint32_t(m) < range) {
+					uint32_t threshold = uint32_t(-range) % range;
+					while (uint32_t(m) < threshold)
+						m = (next() >> 32) * range;
+				}
+				return m >> 32;
+			}
+	};
+
+	//Fisher-Yates: any generator with bounded(range) can be plugged in
+	template <typename RandomIt, typename Rng>
+	void shuffleTiles(RandomIt first, RandomIt last, Rng &rng) {
+		for (size_t i = last - first; i > 1; --i)
+			swap(first[i - 1], first[rng.bounded(i)]);
+	}
+
+	//Batch mode for simulations: fills nBags consecutive bags of BAG_SIZE tiles and
+	//shuffles each one. Bags are taken 16 at a time, each with its own xoshiro128**
+	//stream (the 32 bit sibling of xoshiro256**) kept as structure of arrays, so the 16
+	//streams advance in plain 32 bit loops the compiler turns into SIMD code; all swap
+	//positions are drawn first, then each bag is shuffled on its own. The result depends
+	//only on the seed (and the bag index)
+	void shuffleBags(char *bags, size_t nBags, uint64_t seed) {
+		const size_t LANES = 16;
+		for (size_t group=0; group<nBags; group+=LANES) {
+			uint32_t s0[LANES], s1[LANES], s2[LANES], s3[LANES];
+			uint32_t swapWith[BAG_SIZE][LANES];
+			uint64_t groupSeed = seed ^ (group * 0xD1B54A32D192ED03ull);
+			for (size_t l=0; l<LANES; ++l) {
+				uint64_t a = Xoshiro256::splitmix64(groupSeed), b = Xoshiro256::splitmix64(groupSeed);
+				s0[l] = uint32_t(a);
+				s1[l] = uint32_t(a >> 32);
+				s2[l] = uint32_t(b);
+				s3[l] = uint32_t(b >> 32) | 1;	//state must not be all zeros
+			}
+
+			for (size_t i=BAG_SIZE; i>1; --i)
+				for (size_t l=0; l<LANES; ++l) {	//vectorized: one xoshiro128** step per lane
+					uint32_t r = ((s1[l] * 5) << 7 | (s1[l] * 5) >> 25) * 9;
+					uint32_t t = s1[l] << 9;
+					s2[l] ^= s0[l];
+					s3[l] ^= s1[l];
+					s1[l] ^= s2[l];
+					s0[l] ^= s3[l];
+					s2[l] ^= t;
+					s3[l] = (s3[l] << 11) | (s3[l] >> 21);
+					//top 24 bits times i, in 32 bits: bias below i/2^24, negligible here
+					swapWith[i - 1][l] = ((r >> 8) * uint32_t(i)) >> 24;
+				}
+
+			for (size_t l=0; l<min(LANES, nBags - group); ++l) {
+				char *bag = bags + (group + l) * BAG_SIZE;
+				copy(ALL_LETTERS.begin(), ALL_LETTERS.end(), bag);
+				for (size_t i=BAG_SIZE; i>1; --i)
+					swap(bag[i - 1], bag[swapWith[i - 1][l]]);
+			}
+		}
+	}
+
+	//Tiles handed to a player: a small fixed array, no allocation per draw
+	struct TileRack {
+		array<char, RACK_SIZE> tiles;
+		size_t count = 0;
+		const char *begin() const { return tiles.data(); }
+		const char *end() const { return tiles.data() + count; }
+		size_t size() const { return count; }
+	};
+
+	//Read only view of the letters in the bag when it was taken (the ring may wrap around)
+	class BagView {
+		private:
+			const atomic<char> *slots;
+			size_t first, last;
+		public:
+			class iterator {
+				private:
+					const atomic<char> *slots;
+					size_t pos;
+				public:
+					iterator(const atomic<char> *s, size_t p) : slots(s), pos(p) {}
+					char operator*() const { return slots[pos & (BAG_CAPACITY - 1)].load(memory_order_relaxed); }
+					iterator &operator++() { ++pos; return *this; }
+					bool operator!=(const iterator &other) const { return pos != other.pos; }
+			};
+			BagView(const atomic<char> *s, size_t f, size_t l) : slots(s), first(f), last(l) {}
+			iterator begin() const { return iterator(slots, first); }
+			iterator end() const { return iterator(slots, last); }
+			size_t size() const { return last - first; }
+	};
+
+	//Seeds for new games, read from the system once (random_device can be slow to open)
+	class SeedSource {
+		private:
+			static Registry::SingletonRegistry::Service<SeedSource> service;
+			mutex seedLock;
+			Xoshiro256 rng;
+			SeedSource() : rng((uint64_t(random_device()()) << 32) | random_device()()) {}
+		public:
+			static SeedSource *getInstance() { return service.get(); }
+			uint64_t nextSeed() { lock_guard<mutex> lock(seedLock); return rng.next(); }
+	};
+	Registry::SingletonRegistry::Service<SeedSource> SeedSource::service =
+			Registry::SingletonRegistry::getInstance().declare<SeedSource>("scrabble.seeds", {}, []() { return new SeedSource(); });
+
+	//Points of each letter, a table indexed by the letter
+	class LetterScores {
+		private:
+			static Registry::SingletonRegistry::Service<LetterScores> service;
+			array<int, 256> points;
+			LetterScores();
+		public:
+			static LetterScores *getInstance() { return service.get(); }
+			int getPoints(char letter) const { return points[(unsigned char)letter]; }
+	};
+	LetterScores::LetterScores() {
+		points.fill(0);
+		const pair<const char *, int> values[] = {{"aeioulnrst", 1}, {"dg", 2}, {"bcmp", 3}, {"fhv", 4}, {"jx", 8}, {"qz", 10}};
+		for (auto &value : values)
+			for (const char *letter = value.first; *letter != '\0'; ++letter)
+				points[(unsigned char)*letter] = value.second;
+	}
+	Registry::SingletonRegistry::Service<LetterScores> LetterScores::service =
+			Registry::SingletonRegistry::getInstance().declare<LetterScores>("scrabble.scores", {}, []() { return new LetterScores(); });
+
+	//getInstance goes through the singleton registry: once the instance exists, threads
+	//only do an atomic load (no lock); the bag is created after the seed source it uses
+	//The bag is one array shuffled once, used as a ring: the letters in the bag are the
+	//positions [drawCursor, endCursor). Players draw from many threads without locks: a
+	//draw reserves a run of tiles moving drawCursor with one CAS. Exchanged tiles go back
+	//at the end: a returner reserves positions moving reserveCursor, writes its tiles and
+	//then publishes them moving endCursor, in reservation order. Each slot also has a
+	//sequence number telling the position it is ready for: a returned tile waits until the
+	//player who drew the previous tile of that slot has finished copying it
 	class Singleton {
 		private:
-			static Singleton *uniqueInstance;
-			vector<char> scrabbleLetters;
-			list<char> letterList;
+			static Registry::SingletonRegistry::Service<Singleton> service;
+			array<atomic<char>, BAG_CAPACITY> scrabbleLetters;
+			array<atomic<size_t>, BAG_CAPACITY> slotSequence;	//pos+1: holds the tile of pos; pos: free for pos
+			alignas(64) atomic<size_t> drawCursor;
+			alignas(64) atomic<size_t> endCursor;
+			alignas(64) atomic<size_t> reserveCursor;
 		private:
 			Singleton();
 		public:
 			~Singleton();
 			static Singleton *getInstance();
-			list<char> getLetterList();
-			list<char> getTiles(int qtd);
+			void newGame(uint64_t seed);			//refills the bag; no player may be drawing
+			BagView getLetterList() const;			//letters left, no copy
+			TileRack getTiles(int qtd);				//at most RACK_SIZE, fewer if the bag runs out
+			void returnTiles(const TileRack &rack);	//exchanged tiles go back to the bag
 	};
 	//-------------------------------------------------------------------------
-	Singleton::Singleton() {
-		scrabbleLetters = \
-				{'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a', \
-				 'e', 'e', 'e', 'e', 'e', 'e', 'e', 'e', 'e', 'e', 'e', \
-				 'i', 'i', 'i', 'i', 'i', 'i', 'i', 'i', 'i', 'i', 'i', \
-				 'o', 'o', 'o', 'o', 'o', 'o', 'o', 'o', 'o', 'o', 'o', \
-				 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', \
-				 'b', 'b', 'b', 'c', 'c', 'c', 'd', 'd', 'd', 'f', 'f', \
-				 'f', 'g', 'g', 'g', 'h', 'h', 'h', 'j', 'j', 'j', 'l', \
-				 'l', 'l', 'm', 'm', 'm', 'n', 'n', 'n', 'p', 'p', 'p', \
-				 'q', 'q', 'q', 'r', 'r', 'r', 's', 's', 's', 't', 't', \
-				 't', 'v', 'v', 'v', 'x', 'x', 'x', 'z', 'z', 'z', 'z'};
-		srand(time(0)); //not the best seeding, but...
-		random_shuffle(scrabbleLetters.begin(), scrabbleLetters.end());
-
-		letterList.assign(scrabbleLetters.begin(), scrabbleLetters.end());
+	Singleton::Singleton() : drawCursor(0), endCursor(BAG_SIZE), reserveCursor(BAG_SIZE) {
+		newGame(SeedSource::getInstance()->nextSeed());
+	}
+	//-------------------------------------------------------------------------
+	Singleton::~Singleton() {}
+	//-------------------------------------------------------------------------
+	Registry::SingletonRegistry::Service<Singleton> Singleton::service =
+			Registry::SingletonRegistry::getInstance().declare<Singleton>("scrabble.bag", {"scrabble.seeds"},
+																		  []() { return new Singleton(); });
+	//-------------------------------------------------------------------------
+	void Singleton::newGame(uint64_t seed) {
+		array<char, BAG_SIZE> letters = ALL_LETTERS;
+		Xoshiro256 rng(seed);
+		shuffleTiles(letters.begin(), letters.end(), rng);
+		drawCursor.store(0, memory_order_relaxed);
+		endCursor.store(BAG_SIZE, memory_order_relaxed);
+		reserveCursor.store(BAG_SIZE, memory_order_relaxed);
+		for (size_t i=0; i<BAG_CAPACITY; ++i) {
+			scrabbleLetters[i].store(i < BAG_SIZE ? letters[i] : ' ', memory_order_relaxed);
+			slotSequence[i].store(i < BAG_SIZE ? i + 1 : i, memory_order_relaxed);
+		}
 	}
 	//-------------------------------------------------------------------------
 	Singleton *Singleton::getInstance() {
 		//Lazy instantiation: if instance is not needed, it will never be created
-		if (uniqueInstance == nullptr)
-			uniqueInstance = new Singleton();
-		return uniqueInstance;
+		return service.get();
 	}
 	//-------------------------------------------------------------------------
-	list<char> Singleton::getLetterList() {
-		return uniqueInstance->letterList;
+	BagView Singleton::getLetterList() const {
+		size_t first = drawCursor.load(memory_order_acquire);
+		return BagView(scrabbleLetters.data(), first, max(first, endCursor.load(memory_order_acquire)));
 	}
 	//-------------------------------------------------------------------------
-	list<char> Singleton::getTiles(int qtd) {
-		list<char> tilesToSend;
-		for (int i=0; i<qtd; ++i) {
-			tilesToSend.push_back(uniqueInstance->letterList.front());
-			uniqueInstance->letterList.pop_front();
+	TileRack Singleton::getTiles(int qtd) {
+		TileRack tilesToSend;
+		size_t wanted = min(size_t(max(qtd, 0)), RACK_SIZE);
+		size_t first = drawCursor.load(memory_order_acquire);
+		do {
+			//endCursor is read after first, and neither goes back, so first <= end
+			size_t available = endCursor.load(memory_order_acquire) - first;
+			tilesToSend.count = min(wanted, available);
+			if (tilesToSend.count == 0)
+				return tilesToSend;		//bag is empty
+		} while (!drawCursor.compare_exchange_weak(first, first + tilesToSend.count, memory_order_acq_rel));
+
+		for (size_t i=0; i<tilesToSend.count; ++i) {
+			size_t slot = (first + i) & (BAG_CAPACITY - 1);
+			tilesToSend.tiles[i] = scrabbleLetters[slot].load(memory_order_relaxed);
+			slotSequence[slot].store(first + i + BAG_CAPACITY, memory_order_release);	//slot free again
 		}
 		return tilesToSend;
 	}
+	//-------------------------------------------------------------------------
+	void Singleton::returnTiles(const TileRack &rack) {
+		size_t first = reserveCursor.fetch_add(rack.size(), memory_order_relaxed);
+		for (size_t i=0; i<rack.size(); ++i) {
+			size_t slot = (first + i) & (BAG_CAPACITY - 1);
+			while (slotSequence[slot].load(memory_order_acquire) != first + i)
+				this_thread::yield();	//a slow player is still copying the old tile
+			scrabbleLetters[slot].store(rack.tiles[i], memory_order_relaxed);
+			slotSequence[slot].store(first + i + 1, memory_order_relaxed);	//published by endCursor
+		}
+		//returns reserved before this one must be published first (only waits on returners)
+		size_t expected = first;
+		while (!endCursor.compare_exchange_weak(expected, first + rack.size(), memory_order_release, memory_order_relaxed)) {
+			expected = first;
+			this_thread::yield();
+		}
+	}
+
+
+	//Applies the rules of the game: scores racks and tells whether tiles may still be
+	//exchanged (only while the bag holds a full rack). It depends on the bag and on the
+	//letter scores, which do not depend on each other: on first use they are created in
+	//parallel
+	class Referee {
+		private:
+			static Registry::SingletonRegistry::Service<Referee> service;
+			Singleton *bag;
+			LetterScores *scores;
+			Referee() : bag(Singleton::getInstance()), scores(LetterScores::getInstance()) {}
+		public:
+			static Referee *getInstance() { return service.get(); }
+			int score(const TileRack &rack) const {
+				int total = 0;
+				for (auto elem : rack)
+					total += scores->getPoints(elem);
+				return total;
+			}
+			bool canExchange() const { return bag->getLetterList().size() >= RACK_SIZE; }
+	};
+	Registry::SingletonRegistry::Service<Referee> Referee::service =
+			Registry::SingletonRegistry::getInstance().declare<Referee>("scrabble.referee", {"scrabble.scores", "scrabble.bag"},
+																		[]() { return new Referee(); });
+
+
+	//The Singleton above represents one game. For Monte Carlo tournaments with tens of
+	//thousands of games at once, the pool keeps every bag in a single arena allocation,
+	//laid out as structure of arrays: the letters of all games in one contiguous block,
+	//then the cursor of every game. All bags are shuffled in one shuffleBags call. Each
+	//game is played by one thread at a time, so its cursor needs no synchronization
+	class BagPool {
+		private:
+			size_t nGames;
+			unique_ptr<unsigned char[]> arena;
+			char *letters;		//nGames * BAG_SIZE tiles
+			uint8_t *cursors;	//tiles already drawn from each bag
+		public:
+			BagPool(size_t games, uint64_t seed);
+			size_t getGameCount() const { return nGames; }
+			size_t getMemoryBytes() const { return nGames * (BAG_SIZE + sizeof(uint8_t)); }
+			size_t getTilesLeft(size_t game) const { return BAG_SIZE - cursors[game]; }
+			TileRack getTiles(size_t game, int qtd);	//at most RACK_SIZE, fewer if the bag runs out
+	};
+	//-------------------------------------------------------------------------
+	BagPool::BagPool(size_t games, uint64_t seed) : nGames(games), arena(new unsigned char[games * (BAG_SIZE + sizeof(uint8_t))]) {
+		letters = reinterpret_cast<char *>(arena.get());
+		cursors = arena.get() + nGames * BAG_SIZE;
+		shuffleBags(letters, nGames, seed);
+		fill_n(cursors, nGames, 0);
+	}
+	//-------------------------------------------------------------------------
+	TileRack BagPool::getTiles(size_t game, int qtd) {
+		TileRack tilesToSend;
+		tilesToSend.count = min(min(size_t(max(qtd, 0)), RACK_SIZE), getTilesLeft(game));
+		copy_n(letters + game * BAG_SIZE + cursors[game], tilesToSend.count, tilesToSend.tiles.begin());
+		cursors[game] += tilesToSend.count;
+		return tilesToSend;
+	}
+
+} //end namespace
+
+
+//Only for the benchmark: the naive thread safe version, locking on every call
+namespace LockedSingleton {
+
+	class Singleton {
+		private:
+			static Singleton *uniqueInstance;
+			static mutex creationLock;
+			Singleton() {}
+		public:
+			static Singleton *getInstance() {
+				lock_guard<mutex> lock(creationLock);
+				if (uniqueInstance == nullptr)
+					uniqueInstance = new Singleton();
+				return uniqueInstance;
+			}
+	};
+	Singleton *Singleton::uniqueInstance = nullptr;
+	mutex Singleton::creationLock;
 
 } //end namespace
 
@@ -100,24 +558,225 @@ namespace Scrabble {
 
 using namespace Scrabble;
 
-Singleton *Singleton::uniqueInstance = nullptr;
 
-int main() {
+//BENCHMARK (run with --bench): 64 threads calling getInstance as fast as they can
+template <typename GetInstance>
+void runGetInstanceBenchmark(const char *name, GetInstance getInstance) {
+	const int nThreads = 64, nCalls = 200000;
+	atomic<long> checksum(0);
+	vector<thread> threads;
+	auto start = chrono::steady_clock::now();
+	for (int t=0; t<nThreads; ++t)
+		threads.emplace_back([&]() {
+			long sum = 0;
+			for (int i=0; i<nCalls; ++i)
+				sum += (getInstance() != nullptr);
+			checksum += sum;
+		});
+	for (auto &t : threads)
+		t.join();
+	double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cout << name << ": " << checksum / secs / 1e6 << " M calls/s (" << nThreads << " threads)" << endl;
+}
+
+//STRESS TEST AND BENCHMARK (run with --bench): player threads drawing racks from the
+//shared bag and exchanging them. Afterwards the bag must hold exactly the same letters.
+//Then the players drain the bag: every tile must be drawn once and only once
+array<int, 256> countLetters(const BagView &bag) {
+	array<int, 256> histogram = {};
+	for (auto elem : bag)
+		++histogram[(unsigned char)elem];
+	return histogram;
+}
+
+void runConcurrentDrawBenchmark() {
+	const int nRounds = 100000;
+	Singleton *bag = Singleton::getInstance();
+	array<int, 256> initial = countLetters(bag->getLetterList());
+
+	for (int nPlayers=1; nPlayers<=16; nPlayers*=2) {
+		vector<thread> players;
+		atomic<long> tilesDrawn(0);
+		auto start = chrono::steady_clock::now();
+		for (int p=0; p<nPlayers; ++p)
+			players.emplace_back([&]() {
+				long drawn = 0;
+				for (int r=0; r<nRounds; ++r) {
+					TileRack rack = bag->getTiles(RACK_SIZE);
+					drawn += rack.size();
+					bag->returnTiles(rack);
+				}
+				tilesDrawn += drawn;
+			});
+		for (auto &t : players)
+			t.join();
+		double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		bool conserved = countLetters(bag->getLetterList()) == initial;
+		cout << nPlayers << " player(s): " << nPlayers * nRounds / secs / 1e6 << " M draw+return/s; "
+			 << tilesDrawn / secs / 1e6 << " M tiles/s; bag " << (conserved ? "intact" : "CORRUPTED") << endl;
+	}
+
+	vector<thread> players;
+	vector<array<int, 256>> hands(8, array<int, 256>{});
+	for (int p=0; p<8; ++p)
+		players.emplace_back([&, p]() {
+			for (TileRack rack = bag->getTiles(3); rack.size() > 0; rack = bag->getTiles(3))
+				for (auto elem : rack)
+					++hands[p][(unsigned char)elem];
+		});
+	for (auto &t : players)
+		t.join();
+	array<int, 256> drawn = {};
+	for (auto &hand : hands)
+		for (int c=0; c<256; ++c)
+			drawn[c] += hand[c];
+	cout << "Draining with 8 players: " << (drawn == initial && bag->getLetterList().size() == 0 ? "every tile drawn once" : "MISMATCH") << endl;
+}
+
+//BENCHMARK (run with --bench): shuffling 100k bags with std::shuffle and mt19937, one
+//by one with shuffleTiles and Xoshiro256, and with the batch shuffleBags
+void runShuffleBenchmark() {
+	const size_t nBags = 100000;
+	vector<char> bags(nBags * BAG_SIZE);
+
+	auto start = chrono::steady_clock::now();
+	mt19937_64 mt(1);
+	for (size_t b=0; b<nBags; ++b) {
+		copy(ALL_LETTERS.begin(), ALL_LETTERS.end(), bags.begin() + b * BAG_SIZE);
+		shuffle(bags.begin() + b * BAG_SIZE, bags.begin() + (b + 1) * BAG_SIZE, mt);
+	}
+	double mtMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+	start = chrono::steady_clock::now();
+	Xoshiro256 rng(1);
+	for (size_t b=0; b<nBags; ++b) {
+		copy(ALL_LETTERS.begin(), ALL_LETTERS.end(), bags.begin() + b * BAG_SIZE);
+		shuffleTiles(bags.begin() + b * BAG_SIZE, bags.begin() + (b + 1) * BAG_SIZE, rng);
+	}
+	double xoMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+	start = chrono::steady_clock::now();
+	shuffleBags(bags.data(), nBags, 1);
+	double batchMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+	vector<char> again(nBags * BAG_SIZE);
+	shuffleBags(again.data(), nBags, 1);
+	bool replayable = memcmp(bags.data(), again.data(), bags.size()) == 0;
+	array<char, BAG_SIZE> sorted;
+	copy_n(bags.end() - BAG_SIZE, BAG_SIZE, sorted.begin());
+	sort(sorted.begin(), sorted.end());
+	array<char, BAG_SIZE> expected = ALL_LETTERS;
+	sort(expected.begin(), expected.end());
+
+	cout << "Shuffling " << nBags << " bags: std::shuffle+mt19937 " << mtMs << " ms; shuffleTiles+Xoshiro256 "
+		 << xoMs << " ms; shuffleBags " << batchMs << " ms (" << (replayable ? "same seed, same bags" : "NOT REPLAYABLE")
+		 << ", " << (sorted == expected ? "tiles intact" : "TILES CHANGED") << ")" << endl;
+}
+
+//BENCHMARK (run with --bench): a tournament of 50k games played by a thread pool. In
+//each game 4 simulated players take a rack, then in turns play 1 to 7 tiles and refill
+//from the bag, until the bag is empty. Threads take games 64 at a time
+void runTournamentBenchmark() {
+	const size_t nGames = 50000, chunk = 64, nPlayers = 4;
+	unsigned int nThreads = max(1u, thread::hardware_concurrency());
+
+	auto start = chrono::steady_clock::now();
+	BagPool pool(nGames, 99);
+	atomic<size_t> nextGame(0);
+	atomic<long> totalTurns(0);
+	vector<thread> threads;
+	for (unsigned int t=0; t<nThreads; ++t)
+		threads.emplace_back([&, t]() {
+			Xoshiro256 rng(1000 + t);
+			long turns = 0;
+			for (size_t first = nextGame.fetch_add(chunk); first < nGames; first = nextGame.fetch_add(chunk))
+				for (size_t game=first; game<min(first + chunk, nGames); ++game) {
+					size_t held[nPlayers];
+					for (size_t p=0; p<nPlayers; ++p)
+						held[p] = pool.getTiles(game, RACK_SIZE).size();
+					for (size_t p=0; pool.getTilesLeft(game) > 0; p = (p + 1) % nPlayers, ++turns) {
+						size_t played = min(held[p], size_t(1 + rng.bounded(RACK_SIZE)));
+						held[p] += pool.getTiles(game, played).size() - played;
+					}
+				}
+			totalTurns += turns;
+		});
+	for (auto &t : threads)
+		t.join();
+	double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	cout << "Tournament of " << nGames << " games on " << nThreads << " thread(s): " << nGames / secs
+		 << " games/s; " << double(totalTurns) / nGames << " turns/game; " << pool.getMemoryBytes() / nGames
+		 << " bytes/game" << endl;
+}
+
+int main(int argc, char *argv[]) {
+
+	if (argc > 1 && string(argv[1]) == "--bench") {
+		Registry::SingletonRegistry::getInstance().warmUp();	//creation is not measured below
+		runGetInstanceBenchmark("Registry service (PureSingleton)", PureSingleton::Singleton::getInstance);
+		runGetInstanceBenchmark("Registry service (Scrabble)", Scrabble::Singleton::getInstance);
+		runGetInstanceBenchmark("Mutex on every call", LockedSingleton::Singleton::getInstance);
+		runConcurrentDrawBenchmark();
+		runShuffleBenchmark();
+		runTournamentBenchmark();
+		return 0;
+	}
 
 	//NO THREADING...
+	cout << "SINGLETONS CREATED ON FIRST USE OF THE REFEREE (IN CREATION ORDER):" << endl;
+	Referee *referee = Referee::getInstance();	//bag and letter scores are created in parallel
+	Registry::SingletonRegistry::getInstance().printStartupProfile();
+
 	cout << "SET OF LETTERS FROM SCRABBLE:" << endl;
-	list<char> letterList = Singleton::getInstance()->getLetterList();
+	BagView letterList = Singleton::getInstance()->getLetterList();
 	for (auto elem : letterList) {cout << elem << " ";} cout << endl;
 
 	cout << "SET OF LETTERS OF PLAYER 1:" << endl;
-	list<char> player1Tiles = Singleton::getInstance()->getTiles(7);
-	for (auto elem : player1Tiles) {cout << elem << " ";} cout << endl;
+	TileRack player1Tiles = Singleton::getInstance()->getTiles(7);
+	for (auto elem : player1Tiles) {cout << elem << " ";} cout << "(" << referee->score(player1Tiles) << " points)" << endl;
 
 	cout << "SET OF LETTERS OF PLAYER 1:" << endl;
-	list<char> player2Tiles = Singleton::getInstance()->getTiles(7);
+	TileRack player2Tiles = Singleton::getInstance()->getTiles(7);
 	for (auto elem : player2Tiles) {cout << elem << " ";} cout << endl;
 
+	cout << "PLAYER 2 EXCHANGES ITS TILES:" << endl;
+	if (referee->canExchange()) {
+		Singleton::getInstance()->returnTiles(player2Tiles);
+		player2Tiles = Singleton::getInstance()->getTiles(7);
+	}
+	for (auto elem : player2Tiles) {cout << elem << " ";} cout << endl;
+
+	cout << "LETTERS LEFT IN THE BAG:" << endl;
+	for (auto elem : Singleton::getInstance()->getLetterList()) {cout << elem << " ";} cout << endl;
+
+	cout << "NEW GAME WITH SEED 2024, TWICE (REPLAYABLE):" << endl;
+	for (int game=0; game<2; ++game) {
+		Singleton::getInstance()->newGame(2024);
+		TileRack firstRack = Singleton::getInstance()->getTiles(7);
+		for (auto elem : firstRack) {cout << elem << " ";} cout << endl;
+	}
+
+	cout << "POOL OF 3 GAMES, FIRST RACK OF EACH:" << endl;
+	BagPool pool(3, 2024);
+	for (size_t game=0; game<pool.getGameCount(); ++game) {
+		TileRack firstRack = pool.getTiles(game, 7);
+		for (auto elem : firstRack) {cout << elem << " ";} cout << endl;
+	}
+
 	//THREADING...
+	cout << "GETTING THE INSTANCE FROM 8 THREADS AT ONCE:" << endl;
+	vector<Singleton *> seen(8);
+	vector<thread> threads;
+	for (int t=0; t<8; ++t)
+		threads.emplace_back([&seen, t]() { seen[t] = Singleton::getInstance(); });
+	for (auto &t : threads)
+		t.join();
+	bool sameInstance = all_of(seen.begin(), seen.end(), [&](Singleton *s) { return s == seen[0]; });
+	cout << (sameInstance ? "all threads got the same instance" : "MORE THAN ONE INSTANCE!") << endl;
+
+	cout << "DESTROYING SINGLETONS (REVERSE CREATION ORDER):" << endl;
+	Registry::SingletonRegistry::getInstance().shutdown();
 
 	cout << "END OF PROGRAM" << endl; // prints END OF PROGRAM
 	return 0;